@@ -31,7 +31,11 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
 #include <sys/ioctl.h>
+#include <sys/signalfd.h>
 
 #include "libusb.h"
 
@@ -285,6 +289,62 @@ static int usb_init(int phy_num, void *base, int usb_mode, int usb_speed, int re
 	return 0;
 }
 
+/*
+ * Idle wait: libusb's pollfds and a signalfd for SIGINT/SIGTERM share one
+ * poll(), so a running test sleeps until libusb has work or the operator
+ * stops it.
+ */
+#define HUB_MAX_POLLFDS		32
+
+static int hub_event_loop(libusb_context *ctx)
+{
+	const struct libusb_pollfd **lfds;
+	struct pollfd fds[HUB_MAX_POLLFDS];
+	struct signalfd_siginfo si;
+	struct timeval tv, zero = { 0, 0 };
+	sigset_t mask;
+	int sfd, n, i, timeout, r;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+	if (sfd < 0) {
+		perr("signalfd failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	for (;;) {
+		n = 0;
+		fds[n].fd = sfd;
+		fds[n++].events = POLLIN;
+		lfds = libusb_get_pollfds(ctx);
+		for (i = 0; lfds && lfds[i] && n < HUB_MAX_POLLFDS; i++) {
+			fds[n].fd = lfds[i]->fd;
+			fds[n++].events = lfds[i]->events;
+		}
+		libusb_free_pollfds(lfds);
+
+		timeout = -1;
+		if (libusb_get_next_timeout(ctx, &tv) == 1)
+			timeout = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+		r = poll(fds, n, timeout);
+		if (r < 0 && errno != EINTR) {
+			perr("poll failed: %s\n", strerror(errno));
+			break;
+		}
+		if (fds[0].revents & POLLIN) {
+			if (read(sfd, &si, sizeof(si)) == sizeof(si))
+				printf("signal %u, stopping\n", si.ssi_signo);
+			break;
+		}
+		libusb_handle_events_timeout_completed(ctx, &zero, NULL);
+	}
+	close(sfd);
+	return 0;
+}
+
 static int test_device(uint16_t vid, uint16_t pid, uint16_t portnum)
 {
 	libusb_device_handle *handle;
@@ -333,9 +393,18 @@ static int test_device(uint16_t vid, uint16_t pid, uint16_t portnum)
 		}
 	}
 
-	while (1) {
-		usleep(100);
+	printf("Test running, press Ctrl-C to stop\n");
+	hub_event_loop(NULL);
+
+	/* the test port itself only leaves PORT_TEST through a reset */
+	if (hub_test_mode && !upstream_flag) {
+		for (i = 1; i < (maxchild+1); i++) {
+			if (i != portnum)
+				libusb_control_transfer(handle, 0x23,
+						0x01, 0x0002, i, 0, 0, 100);
+		}
 	}
+
 	printf("Closing device...\n");
 	libusb_close(handle);
 
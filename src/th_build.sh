@@ -1 +1 @@
-/tool/gcc_linaro/gcc-linaro-7.3.1-2018.05-x86_64_aarch64-linux-gnu/bin/aarch64-linux-gnu-gcc th_usb_test.c ./libusb-1.0.a ./libpthread.a -static -o th_usb_test
+/tool/gcc_linaro/gcc-linaro-7.3.1-2018.05-x86_64_aarch64-linux-gnu/bin/aarch64-linux-gnu-gcc th_usb_test.c ./libusb-1.0.a ./libpthread.a -lrt -static -o th_usb_test
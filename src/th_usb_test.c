@@ -20,18 +20,29 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 
+#include <pthread.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 
 #include "libusb.h"
 
@@ -57,12 +68,32 @@
 #define PHY_NCR_REG		0x70026A33
 #define PHY_NCR_REG_MASK	0x00020233
 
+#define USB_GCTL		0xC110
+#define USB_PORTSC_U2		0x420
+#define USB_PORTSC_U3		0x430
+#define USB_GDBGLTSSM		0xC164
+#define USB_DSTS		0xC70C
+
 #define USB_TEST_J 1
 #define USB_TEST_K 2
 #define USB_TEST_SE0 3
 #define USB_TEST_PACKET 4
 #define USB_TEST_SOF 5
 
+/* hub class requests, USB 2.0 chapter 11 */
+#define HUB_REQ_PORT_OUT	(LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_OTHER)
+#define HUB_REQ_DEVICE_IN	(LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_DEVICE)
+#define USB_PORT_FEAT_SUSPEND	0x0002
+#define USB_PORT_FEAT_TEST	0x0015
+#define USB_DEVICE_TEST_MODE	0x0002
+/* SuperSpeed hub features, USB 3.x chapter 10 */
+#define USB_PORT_FEAT_LINK_STATE	0x0005
+#define USB_PORT_FEAT_BH_RESET		0x001c
+#define USB_SS_LINK_COMPLIANCE		0x0a
+
+#define HUB_PORT_TIMEOUT	100
+#define HUB_DESC_TIMEOUT	1000
+
 /* low level macros for accessing memory mapped hardware registers */
 #define REG64(addr) ((volatile uint64_t *)(uintptr_t)(addr))
 #define REG32(addr) ((volatile uint32_t *)(uintptr_t)(addr))
@@ -114,239 +145,3919 @@ struct usb_data {
 	data.internal = internal;
 	data.enable = enable;
 
-	fd = open("/dev/usbclk", O_RDWR);
-	if (fd < 0) {
-		printf("open /dev/usbclk fail fd %d\n", fd);
-		return fd;
+	fd = open("/dev/usbclk", O_RDWR);
+	if (fd < 0) {
+		printf("open /dev/usbclk fail fd %d\n", fd);
+		return fd;
+	}
+
+	ret = ioctl(fd, USB_SET_CLK_CMD, &data);
+	if (ret < 0) {
+		printf("ioctl fail\n");
+		return ret;
+	}
+
+	close(fd);
+}*/
+
+/*
+ * Link capture: every sample is kept raw in a small circular buffer and the
+ * triggers are evaluated against the previous sample. When one fires, the
+ * pre-trigger history plus the next N samples are written to the capture
+ * file, logic analyzer style.
+ */
+struct link_sample {
+	uint64_t ts;		/* CLOCK_MONOTONIC, ns */
+	uint32_t gctl;
+	uint32_t portsc_u2;
+	uint32_t portsc_u3;
+	uint32_t ltssm;
+	uint32_t dsts;
+};
+
+enum link_field {
+	LF_GCTL_OPMODE,
+	LF_U2_SPD,
+	LF_U3_SPD,
+	LF_U3_LINK,
+	LF_LTSSM_LINK,
+	LF_LTSSM_SUB,
+	LF_DSTS_SPEED,
+	LF_DSTS_LINK,
+	LF_NUM
+};
+
+/*
+ * Samples hold raw register words only; fields are decoded on output or
+ * when a trigger looks at them. All decode information is in the const
+ * tables below.
+ */
+struct link_field_desc {
+	const char *name;
+	size_t offset;
+	unsigned int shift;
+	unsigned int mask;
+	const char *const *names;	/* value names, indexed by field value */
+};
+
+/* GDBGLTSSM and DSTS link state: the controller's LTSSM encoding */
+static const char *const link_state_names[16] = {
+	"U0", "U1", "U2", "U3", "SS.Disabled", "Rx.Detect", "SS.Inactive", "Polling",
+	"Recovery", "Hot.Reset", "Compliance", "Loopback", NULL, NULL, NULL, "Resume",
+};
+
+/* PORTSC PLS (xHCI 5.4.8): same as above except 11 is Test Mode */
+static const char *const portsc_pls_names[16] = {
+	"U0", "U1", "U2", "U3", "SS.Disabled", "Rx.Detect", "SS.Inactive", "Polling",
+	"Recovery", "Hot.Reset", "Compliance", "Test.Mode", NULL, NULL, NULL, "Resume",
+};
+
+static const char *const portsc_speed_names[16] = {
+	NULL, "FS", "LS", "HS", "SS", "SSP",
+};
+
+static const char *const dsts_speed_names[8] = {
+	"HS", "FS", "LS", NULL, "SS", "SSP",
+};
+
+static const char *const opmode_names[4] = {
+	NULL, "Host", "Device", "OTG",
+};
+
+static const struct link_field_desc link_fields[LF_NUM] = {
+	[LF_GCTL_OPMODE] = { "gctl_opmode", offsetof(struct link_sample, gctl), 12, 0x3, opmode_names },
+	[LF_U2_SPD] = { "u2_spd", offsetof(struct link_sample, portsc_u2), 10, 0xf, portsc_speed_names },
+	[LF_U3_SPD] = { "u3_spd", offsetof(struct link_sample, portsc_u3), 10, 0xf, portsc_speed_names },
+	[LF_U3_LINK] = { "u3_link", offsetof(struct link_sample, portsc_u3), 5, 0xf, portsc_pls_names },
+	[LF_LTSSM_LINK] = { "ltssm_link", offsetof(struct link_sample, ltssm), 22, 0xf, link_state_names },
+	[LF_LTSSM_SUB] = { "ltssm_sub", offsetof(struct link_sample, ltssm), 18, 0xf, NULL },
+	[LF_DSTS_SPEED] = { "dsts_speed", offsetof(struct link_sample, dsts), 0, 0x7, dsts_speed_names },
+	[LF_DSTS_LINK] = { "dsts_link", offsetof(struct link_sample, dsts), 18, 0xf, link_state_names },
+};
+
+static inline unsigned int link_field_get(const struct link_sample *s, int field)
+{
+	const struct link_field_desc *d = &link_fields[field];
+
+	return (*(const uint32_t *)((const char *)s + d->offset) >> d->shift) & d->mask;
+}
+
+static const char *link_field_name(int field, unsigned int value)
+{
+	const char *const *names = link_fields[field].names;
+
+	if (names == NULL || names[value] == NULL)
+		return "-";
+	return names[value];
+}
+
+#define TRIG_EQ		0
+#define TRIG_NE		1
+#define TRIG_CHANGE	2
+
+#define MAX_TRIGGERS	8
+#define MAX_CAPTURE_SAMPLES	1000000	/* -pre/-post limit, 100 s at the default period */
+
+struct link_trigger {
+	const char *expr;
+	int field;
+	int op;
+	unsigned int value;
+};
+
+/*
+ * Sampler self-measurement: inter-sample intervals go into a log-linear
+ * histogram (128 sub-buckets per power of two, <1% error) and missed
+ * timer expirations are counted as overruns, so gaps in a trace can be
+ * told apart from link events.
+ */
+#define JITTER_SUB	128
+#define JITTER_BINS	(JITTER_SUB * 58)
+
+struct link_jitter {
+	uint32_t hist[JITTER_BINS];
+	uint64_t count;
+	uint64_t max;		/* ns */
+	uint64_t last_ts;
+	uint64_t overruns;	/* wakeups that found more than one expiration */
+	uint64_t missed;	/* samples lost to those overruns */
+};
+
+static unsigned int jitter_bin(uint64_t v)
+{
+	unsigned int g;
+
+	if (v < 2 * JITTER_SUB)
+		return v;
+	g = 63 - __builtin_clzll(v) - 7;
+	return JITTER_SUB * (g + 1) + (unsigned int)(v >> g) - JITTER_SUB;
+}
+
+static uint64_t jitter_bin_value(unsigned int bin)
+{
+	unsigned int g;
+
+	if (bin < 2 * JITTER_SUB)
+		return bin;
+	g = bin / JITTER_SUB - 1;
+	return (uint64_t)(bin % JITTER_SUB + JITTER_SUB) << g;
+}
+
+static void jitter_hist_add(struct link_jitter *j, uint64_t d)
+{
+	j->hist[jitter_bin(d)]++;
+	j->count++;
+	if (d > j->max)
+		j->max = d;
+}
+
+static void jitter_add(struct link_jitter *j, uint64_t ts, uint64_t expirations)
+{
+	uint64_t d;
+
+	if (expirations > 1) {
+		j->overruns++;
+		j->missed += expirations - 1;
+	}
+	if (j->last_ts) {
+		d = ts - j->last_ts;
+		jitter_hist_add(j, d);
+	}
+	j->last_ts = ts;
+}
+
+static void jitter_merge(struct link_jitter *dst, const struct link_jitter *src)
+{
+	unsigned int i;
+
+	for (i = 0; i < JITTER_BINS; i++)
+		dst->hist[i] += src->hist[i];
+	dst->count += src->count;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+/* p in per mille, e.g. 500 for the median */
+static uint64_t jitter_percentile(const struct link_jitter *j, unsigned int p)
+{
+	uint64_t want, seen = 0;
+	unsigned int i;
+
+	if (j->count == 0)
+		return 0;
+	want = (j->count * p + 999) / 1000;
+	for (i = 0; i < JITTER_BINS; i++) {
+		seen += j->hist[i];
+		if (seen >= want)
+			return jitter_bin_value(i);
+	}
+	return j->max;
+}
+
+static void jitter_report(FILE *out, const char *prefix, unsigned int num, unsigned int period_us, const struct link_jitter *j)
+{
+	fprintf(out, "%susb%u quality: period %u us, intervals %llu, p50 %.1f us, p99 %.1f us, max %.1f us, overruns %llu, missed %llu\n",
+		prefix, num, period_us, (unsigned long long)j->count,
+		jitter_percentile(j, 500) / 1000.0, jitter_percentile(j, 990) / 1000.0, j->max / 1000.0,
+		(unsigned long long)j->overruns, (unsigned long long)j->missed);
+}
+
+struct link_capture {
+	struct link_trigger trig[MAX_TRIGGERS];
+	int ntrig;
+	struct link_sample *ring;
+	unsigned int pre;	/* samples of history kept before the trigger */
+	unsigned int post;	/* samples recorded after the trigger */
+	unsigned int head;
+	unsigned int count;
+	unsigned int post_left;
+	uint64_t events;
+	bool have_prev;
+	struct link_sample prev;
+	const char *path;
+	FILE *out;
+	/* quality footer of every window */
+	unsigned int num;
+	unsigned int period_us;
+	const struct link_jitter *jit;
+};
+
+/* trigger list and window sizes, copied into each monitored port */
+static struct link_capture capture_cfg = {
+	.pre = 1000,
+	.post = 1000,
+	.path = "link_capture.txt",
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* the only per-sample work: one load per register, nothing decoded */
+static void link_sample_read(void *base, struct link_sample *s)
+{
+	s->gctl = readl(base + USB_GCTL);
+	s->portsc_u2 = readl(base + USB_PORTSC_U2);
+	s->portsc_u3 = readl(base + USB_PORTSC_U3);
+	s->ltssm = readl(base + USB_GDBGLTSSM);
+	s->dsts = readl(base + USB_DSTS);
+}
+
+/*
+ * Mode specialized samplers, picked once per port from GCTL.PRTCAPDIR:
+ * host mode has no use for DSTS and device mode none for PORTSC, so each
+ * reads only its own registers. GCTL itself comes from the port.
+ */
+typedef void (*link_sampler_fn)(void *base, struct link_sample *s);
+
+static void link_sample_host(void *base, struct link_sample *s)
+{
+	s->portsc_u2 = readl(base + USB_PORTSC_U2);
+	s->portsc_u3 = readl(base + USB_PORTSC_U3);
+	s->ltssm = readl(base + USB_GDBGLTSSM);
+}
+
+static void link_sample_device(void *base, struct link_sample *s)
+{
+	s->ltssm = readl(base + USB_GDBGLTSSM);
+	s->dsts = readl(base + USB_DSTS);
+}
+
+static void link_sample_all(void *base, struct link_sample *s)
+{
+	s->portsc_u2 = readl(base + USB_PORTSC_U2);
+	s->portsc_u3 = readl(base + USB_PORTSC_U3);
+	s->ltssm = readl(base + USB_GDBGLTSSM);
+	s->dsts = readl(base + USB_DSTS);
+}
+
+/* whether a field's register is read by the sampler chosen for this mode */
+static bool link_field_sampled(int field, unsigned int opmode)
+{
+	size_t off = link_fields[field].offset;
+
+	if (opmode == 0x1)
+		return off != offsetof(struct link_sample, dsts);
+	if (opmode == 0x2)
+		return off != offsetof(struct link_sample, portsc_u2) && off != offsetof(struct link_sample, portsc_u3);
+	return true;
+}
+
+/* decode on output only */
+static void link_sample_print(const struct link_sample *s)
+{
+	unsigned int ltssm_link = link_field_get(s, LF_LTSSM_LINK);
+
+	if (link_field_get(s, LF_GCTL_OPMODE) == 0x2) { // Device mode
+		unsigned int speed = link_field_get(s, LF_DSTS_SPEED);
+		unsigned int link = link_field_get(s, LF_DSTS_LINK);
+
+		printf("DSTS: %08X, DSTS_SPEED: %X (%s), DSTS_LINK: %X (%s).\n", s->dsts,
+			speed, link_field_name(LF_DSTS_SPEED, speed), link, link_field_name(LF_DSTS_LINK, link));
+	} else {
+		unsigned int u3lt = link_field_get(s, LF_U3_LINK);
+		unsigned int u2spd = link_field_get(s, LF_U2_SPD);
+		unsigned int u3spd = link_field_get(s, LF_U3_SPD);
+
+		printf("PORTSC_U2: %08X, PORTSC_U3: %08X, PORTSC_U3_Link: %0X (%s), PORTSC_U2_SPD %0X (%s), PORTSC_U3_SPD %X (%s).\n",
+			s->portsc_u2, s->portsc_u3, u3lt, link_field_name(LF_U3_LINK, u3lt),
+			u2spd, link_field_name(LF_U2_SPD, u2spd), u3spd, link_field_name(LF_U3_SPD, u3spd));
+	}
+	printf("LTSSM: %08X, LTSSM_LINK: %08X (%s), LTSSM_SUB: %0X.\n", s->ltssm,
+		ltssm_link, link_field_name(LF_LTSSM_LINK, ltssm_link), link_field_get(s, LF_LTSSM_SUB));
+}
+
+void usb_check_link_state(void *usbctrlcr_base)
+{
+	struct link_sample s;
+
+	s.ts = now_ns();
+	link_sample_read(usbctrlcr_base, &s);
+	link_sample_print(&s);
+}
+
+/* "field==val", "field!=val" or "field:change", val in decimal or 0x hex */
+static int link_trigger_parse(const char *expr, struct link_trigger *t)
+{
+	const char *p;
+	size_t len;
+	char *end;
+	int f;
+
+	for (p = expr; *p && *p != '=' && *p != '!' && *p != ':'; p++)
+		;
+	len = p - expr;
+	for (f = 0; f < LF_NUM; f++)
+		if (strlen(link_fields[f].name) == len && strncmp(expr, link_fields[f].name, len) == 0)
+			break;
+	if (f == LF_NUM)
+		return -1;
+	t->expr = expr;
+	t->field = f;
+	t->value = 0;
+
+	if (strcmp(p, ":change") == 0) {
+		t->op = TRIG_CHANGE;
+		return 0;
+	}
+	if (strncmp(p, "==", 2) == 0)
+		t->op = TRIG_EQ;
+	else if (strncmp(p, "!=", 2) == 0)
+		t->op = TRIG_NE;
+	else
+		return -1;
+	t->value = strtoul(p + 2, &end, 0);
+	if (end == p + 2 || *end != '\0')
+		return -1;
+	return 0;
+}
+
+/* Edge triggered: a condition fires only on the sample where it becomes true */
+static int link_trigger_eval(const struct link_capture *cap, const struct link_sample *s)
+{
+	const struct link_trigger *t;
+	unsigned int cur, old;
+	int i;
+
+	for (i = 0; i < cap->ntrig; i++) {
+		t = &cap->trig[i];
+		cur = link_field_get(s, t->field);
+		old = link_field_get(&cap->prev, t->field);
+		switch (t->op) {
+		case TRIG_EQ:
+			if (cur == t->value && old != t->value)
+				return i;
+			break;
+		case TRIG_NE:
+			if (cur != t->value && old == t->value)
+				return i;
+			break;
+		case TRIG_CHANGE:
+			if (cur != old)
+				return i;
+			break;
+		}
+	}
+	return -1;
+}
+
+static void link_capture_write(FILE *out, const struct link_sample *s)
+{
+	int f;
+
+	fprintf(out, "%llu %08X %08X %08X %08X %08X",
+		(unsigned long long)s->ts, s->gctl, s->portsc_u2, s->portsc_u3, s->ltssm, s->dsts);
+	for (f = 0; f < LF_NUM; f++) {
+		unsigned int v = link_field_get(s, f);
+
+		if (link_fields[f].names)
+			fprintf(out, " %s=%X(%s)", link_fields[f].name, v, link_field_name(f, v));
+		else
+			fprintf(out, " %s=%X", link_fields[f].name, v);
+	}
+	fprintf(out, "\n");
+}
+
+static int link_capture_init(struct link_capture *cap, const char *path)
+{
+	cap->path = path;
+	cap->ring = calloc(cap->pre + 1, sizeof(*cap->ring));
+	if (cap->ring == NULL) {
+		perr("capture: no memory for %u samples\n", cap->pre + 1);
+		return -1;
+	}
+	cap->out = fopen(cap->path, "a");
+	if (cap->out == NULL) {
+		perr("capture: open %s failed\n", cap->path);
+		free(cap->ring);
+		cap->ring = NULL;
+		return -1;
+	}
+	printf("capture: %d trigger(s), pre %u post %u -> %s\n", cap->ntrig, cap->pre, cap->post, cap->path);
+	return 0;
+}
+
+static void link_capture_end(struct link_capture *cap, const char *why)
+{
+	fprintf(cap->out, "# end%s\n", why);
+	if (cap->jit)
+		jitter_report(cap->out, "# ", cap->num, cap->period_us, cap->jit);
+	fflush(cap->out);
+}
+
+/* missed timer ticks inside a window are marked so the gap is not read as a link event */
+static void link_capture_gap(struct link_capture *cap, uint64_t ts, uint64_t missed)
+{
+	if (cap->post_left)
+		fprintf(cap->out, "# overrun at %llu, %llu sample(s) missed\n",
+			(unsigned long long)ts, (unsigned long long)missed);
+}
+
+static void link_capture_feed(struct link_capture *cap, const struct link_sample *s)
+{
+	unsigned int size = cap->pre + 1;
+	unsigned int i, idx;
+	int t;
+
+	cap->ring[cap->head] = *s;
+	cap->head = (cap->head + 1) % size;
+	if (cap->count < size)
+		cap->count++;
+
+	if (cap->post_left) {
+		link_capture_write(cap->out, s);
+		if (--cap->post_left == 0)
+			link_capture_end(cap, "");
+	} else if (cap->have_prev && (t = link_trigger_eval(cap, s)) >= 0) {
+		cap->events++;
+		printf("capture: trigger %s fired, event %llu\n", cap->trig[t].expr, (unsigned long long)cap->events);
+		fprintf(cap->out, "# event %llu trigger %s at %llu, pre %u post %u\n",
+			(unsigned long long)cap->events, cap->trig[t].expr,
+			(unsigned long long)s->ts, cap->count - 1, cap->post);
+		/* oldest first, the trigger sample is the last one in the ring */
+		for (i = 0; i < cap->count; i++) {
+			idx = (cap->head + size - cap->count + i) % size;
+			link_capture_write(cap->out, &cap->ring[idx]);
+		}
+		cap->post_left = cap->post;
+		if (cap->post_left == 0)
+			link_capture_end(cap, "");
+	}
+	cap->prev = *s;
+	cap->have_prev = true;
+}
+
+static void link_capture_close(struct link_capture *cap)
+{
+	if (cap->out == NULL)
+		return;
+	if (cap->post_left)
+		link_capture_end(cap, ", interrupted");
+	fclose(cap->out);
+	cap->out = NULL;
+	free(cap->ring);
+	cap->ring = NULL;
+}
+
+/*
+ * Flap detector: link up/down and speed are derived from the words the
+ * monitor already read (PORTSC_U3/PORTSC_U2 in host mode, DSTS in device
+ * mode). Every drop or speed change while up is a flap; the intervals
+ * between flaps are kept and an alarm is raised when N flaps fall
+ * within a window of S seconds.
+ */
+enum link_speed {
+	SPD_NONE,
+	SPD_LS,
+	SPD_FS,
+	SPD_HS,
+	SPD_SS,
+	SPD_SSP,
+};
+
+static const char *const link_speed_names[] = {
+	"down", "LS", "FS", "HS", "SS", "SSP",
+};
+
+static const unsigned char portsc_speed_map[16] = {
+	[1] = SPD_FS, [2] = SPD_LS, [3] = SPD_HS, [4] = SPD_SS, [5] = SPD_SSP,
+};
+
+static const unsigned char dsts_speed_map[8] = {
+	[0] = SPD_HS, [1] = SPD_FS, [2] = SPD_LS, [4] = SPD_SS, [5] = SPD_SSP,
+};
+
+#define PORTSC_CCS	(1 << 0)
+#define LINK_SS_DISABLED	0x4
+#define LINK_SS_INACTIVE	0x6
+#define LINK_RECOVERY	0x8
+#define DSTS_USB2_EARLY_SUSPEND	0x5
+#define DSTS_USB2_RESET		0xe
+#define DSTS_USB2_RESUME	0xf
+#define MAX_FLAP_ALARM	64
+
+struct link_flap {
+	bool valid;
+	bool alarm_active;
+	unsigned int speed;
+	unsigned int up_speed;	/* last speed the link was up at, for fallbacks across a reconnect */
+	unsigned int ltssm_link;
+	uint64_t ups;
+	uint64_t downs;
+	uint64_t speed_changes;
+	uint64_t fallbacks;	/* SuperSpeed lost, link kept at USB2 speed */
+	uint64_t recoveries;
+	uint64_t flaps;
+	uint64_t alarms;
+	uint64_t last_flap_ts;
+	uint64_t min_interval;
+	uint64_t max_interval;
+	uint64_t sum_interval;
+	uint64_t recent[MAX_FLAP_ALARM];	/* timestamps of the last flaps, for the rate alarm */
+	uint64_t state_since;
+	uint64_t residency[16];	/* ns spent in each LTSSM link state, current one excluded */
+};
+
+static unsigned int flap_alarm_count;
+static unsigned int flap_alarm_secs;
+
+/*
+ * USB3 link states U0..U3 mean the link is trained and SS.Disabled,
+ * Rx.Detect and SS.Inactive that it is lost; Recovery, Hot.Reset and the
+ * other training states are passed on every U1/U2 exit and retrain, so
+ * they keep the previous speed. USB2 device link states 0/2/3 (On/L1/L2)
+ * are up, Early Suspend, Reset and Resume keep the previous speed.
+ */
+static bool link_ss_lost(unsigned int pls)
+{
+	return pls >= LINK_SS_DISABLED && pls <= LINK_SS_INACTIVE;
+}
+
+static unsigned int link_flap_speed(const struct link_sample *s, unsigned int prev)
+{
+	unsigned int pls, speed;
+
+	if (link_field_get(s, LF_GCTL_OPMODE) == 0x2) {
+		speed = dsts_speed_map[link_field_get(s, LF_DSTS_SPEED)];
+		pls = link_field_get(s, LF_DSTS_LINK);
+		if (speed >= SPD_SS)
+			return pls <= 3 ? speed : link_ss_lost(pls) ? SPD_NONE : prev;
+		if (pls == 0 || pls == 2 || pls == 3)
+			return speed;
+		if (pls == DSTS_USB2_EARLY_SUSPEND || pls == DSTS_USB2_RESET || pls == DSTS_USB2_RESUME)
+			return prev;
+		return SPD_NONE;
+	}
+
+	pls = link_field_get(s, LF_U3_LINK);
+	if ((s->portsc_u3 & PORTSC_CCS) && !link_ss_lost(pls))
+		return pls <= 3 ? portsc_speed_map[link_field_get(s, LF_U3_SPD)] : prev;
+	if (s->portsc_u2 & PORTSC_CCS)
+		return portsc_speed_map[link_field_get(s, LF_U2_SPD)];
+	return SPD_NONE;
+}
+
+static void link_flap_rate(struct link_flap *f, unsigned int num, uint64_t ts)
+{
+	uint64_t oldest;
+
+	if (flap_alarm_count == 0)
+		return;
+	f->recent[f->flaps % flap_alarm_count] = ts;
+	if (f->flaps < flap_alarm_count)
+		return;
+	/* after the store above, the slot for the next flap holds the oldest of the last N */
+	oldest = f->recent[(f->flaps + 1) % flap_alarm_count];
+	if (ts - oldest <= (uint64_t)flap_alarm_secs * 1000000000ull) {
+		if (!f->alarm_active) {
+			f->alarm_active = true;
+			f->alarms++;
+			printf("\033[31mflap alarm: usb%u %u flaps within %.3f s\033[00m\n",
+				num, flap_alarm_count, (ts - oldest) / 1e9);
+		}
+	} else {
+		f->alarm_active = false;
+	}
+}
+
+static void link_flap_update(struct link_flap *f, unsigned int num, const struct link_sample *s)
+{
+	unsigned int speed = link_flap_speed(s, f->speed);
+	unsigned int ltssm_link = link_field_get(s, LF_LTSSM_LINK);
+	uint64_t d;
+
+	if (!f->valid) {
+		f->valid = true;
+		f->speed = speed;
+		f->up_speed = speed;
+		f->ltssm_link = ltssm_link;
+		f->state_since = s->ts;
+		return;
+	}
+	if (ltssm_link != f->ltssm_link) {
+		if (ltssm_link == LINK_RECOVERY)
+			f->recoveries++;
+		f->residency[f->ltssm_link] += s->ts - f->state_since;
+		f->state_since = s->ts;
+		f->ltssm_link = ltssm_link;
+	}
+	if (speed == f->speed)
+		return;
+
+	printf("link: usb%u %s -> %s at %llu\n", num, link_speed_names[f->speed], link_speed_names[speed],
+		(unsigned long long)s->ts);
+
+	if (f->speed == SPD_NONE) {
+		f->ups++;
+		/* a real fallback reconnects at USB2 after samples with no link at all */
+		if (f->up_speed >= SPD_SS && speed < SPD_SS)
+			f->fallbacks++;
+	} else {
+		if (speed == SPD_NONE) {
+			f->downs++;
+		} else {
+			f->speed_changes++;
+			if (f->speed >= SPD_SS && speed < SPD_SS)
+				f->fallbacks++;
+		}
+		f->flaps++;
+		if (f->last_flap_ts) {
+			d = s->ts - f->last_flap_ts;
+			if (f->min_interval == 0 || d < f->min_interval)
+				f->min_interval = d;
+			if (d > f->max_interval)
+				f->max_interval = d;
+			f->sum_interval += d;
+		}
+		f->last_flap_ts = s->ts;
+		link_flap_rate(f, num, s->ts);
+	}
+	f->speed = speed;
+	if (speed != SPD_NONE)
+		f->up_speed = speed;
+}
+
+static void link_flap_report(FILE *out, unsigned int num, const struct link_flap *f)
+{
+	fprintf(out, "usb%u flaps: %llu (down %llu, speed change %llu, SS fallback %llu), up %llu, recovery %llu, alarms %llu",
+		num, (unsigned long long)f->flaps, (unsigned long long)f->downs,
+		(unsigned long long)f->speed_changes, (unsigned long long)f->fallbacks,
+		(unsigned long long)f->ups, (unsigned long long)f->recoveries, (unsigned long long)f->alarms);
+	if (f->flaps > 1)
+		fprintf(out, ", interval min %.3f s, mean %.3f s, max %.3f s",
+			f->min_interval / 1e9, f->sum_interval / 1e9 / (f->flaps - 1), f->max_interval / 1e9);
+	fprintf(out, "\n");
+}
+
+/*
+ * Multi-port monitor: every mapped controller is sampled from one epoll
+ * loop. Ports sharing a period share a timerfd, and all timers start from
+ * the same absolute CLOCK_MONOTONIC instant, so samples from different
+ * ports line up and carry the same timestamp base.
+ */
+#define MAX_PORTS	4
+
+struct link_port {
+	unsigned int num;
+	void *base;
+	unsigned int period_us;
+	uint32_t gctl;		/* re-read every GCTL_RECHECK_NS, selects the sampler */
+	uint64_t gctl_ts;
+	link_sampler_fn sample;
+	uint64_t samples;
+	struct link_jitter jit;
+	struct link_flap flap;
+	struct link_capture cap;
+	char cap_path[256];
+	struct link_feed_port *feed;
+	struct link_sample last;
+	/* set by the test setup, exported as metrics */
+	uint64_t init_ns;
+	bool tuned;
+	unsigned int tune[3];
+};
+
+struct link_timer {
+	int fd;
+	unsigned int period_us;
+	int port[MAX_PORTS];
+	int nport;
+};
+
+static struct link_port ports[MAX_PORTS];
+static int nports;
+static unsigned int monitor_period_us = 100;
+static bool monitor_quiet = false;
+
+/*
+ * Live feed: the latest sample and counters of every port are published
+ * in a POSIX shared memory segment. Each port is guarded by its own
+ * seqlock, so any number of local readers can poll it without syscalls
+ * and without ever blocking the sampler. Fields are re-decoded only when
+ * a raw register word changed.
+ */
+#define LINK_FEED_NAME		"/th_usb_link"
+#define LINK_FEED_MAGIC		0x4C4E4B46	/* "LNKF" */
+#define LINK_FEED_VERSION	2
+
+struct link_feed_port {
+	uint32_t seq;		/* odd while the sampler is writing */
+	uint32_t num;
+	uint32_t period_us;
+	uint32_t pad;
+	struct link_sample last;
+	uint32_t field[LF_NUM];
+	uint64_t ts;		/* time of the latest sample */
+	uint64_t samples;
+	uint64_t changes;	/* samples where any raw word changed */
+	uint64_t overruns;
+	uint64_t missed;
+	uint64_t events;	/* capture triggers fired */
+	uint32_t speed;		/* enum link_speed */
+	uint32_t alarm;		/* flap rate alarm active */
+	uint64_t ups;
+	uint64_t downs;
+	uint64_t speed_changes;
+	uint64_t fallbacks;
+	uint64_t recoveries;
+	uint64_t flaps;
+	uint64_t alarms;
+} __attribute__((aligned(64)));
+
+struct link_feed {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	uint32_t nports;
+	uint32_t running;
+	uint32_t pid;
+	struct link_feed_port port[MAX_PORTS];
+};
+
+static const char *feed_name;
+static struct link_feed *feed;
+
+static int link_feed_create(void)
+{
+	int fd, i;
+
+	fd = shm_open(feed_name, O_CREAT | O_RDWR, 0644);
+	if (fd < 0) {
+		perr("feed: shm_open %s failed: %s\n", feed_name, strerror(errno));
+		return -1;
+	}
+	if (ftruncate(fd, sizeof(*feed)) < 0) {
+		perr("feed: ftruncate failed: %s\n", strerror(errno));
+		close(fd);
+		return -1;
+	}
+	feed = mmap(NULL, sizeof(*feed), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (feed == MAP_FAILED) {
+		feed = NULL;
+		perr("feed: mmap failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	/* readers check magic last, so fill everything else first */
+	__atomic_store_n(&feed->magic, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memset(&feed->version, 0, sizeof(*feed) - offsetof(struct link_feed, version));
+	feed->version = LINK_FEED_VERSION;
+	feed->size = sizeof(*feed);
+	feed->nports = nports;
+	feed->pid = getpid();
+	feed->running = 1;
+	for (i = 0; i < nports; i++) {
+		feed->port[i].num = ports[i].num;
+		feed->port[i].period_us = ports[i].period_us;
+		ports[i].feed = &feed->port[i];
+	}
+	__atomic_store_n(&feed->magic, LINK_FEED_MAGIC, __ATOMIC_RELEASE);
+	printf("feed: publishing %d port(s) in shm %s\n", nports, feed_name);
+	return 0;
+}
+
+static void link_feed_close(void)
+{
+	int i;
+
+	if (feed == NULL)
+		return;
+	__atomic_store_n(&feed->running, 0, __ATOMIC_RELEASE);
+	for (i = 0; i < nports; i++)
+		ports[i].feed = NULL;
+	munmap(feed, sizeof(*feed));
+	feed = NULL;
+}
+
+static void link_feed_publish(struct link_port *p, const struct link_sample *s)
+{
+	struct link_feed_port *f = p->feed;
+	uint32_t seq = f->seq;
+	int i;
+
+	__atomic_store_n(&f->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	if (f->last.gctl != s->gctl || f->last.portsc_u2 != s->portsc_u2 || f->last.portsc_u3 != s->portsc_u3 ||
+	    f->last.ltssm != s->ltssm || f->last.dsts != s->dsts || f->samples == 0) {
+		for (i = 0; i < LF_NUM; i++)
+			f->field[i] = link_field_get(s, i);
+		f->changes++;
+	}
+	f->last = *s;
+	f->ts = s->ts;
+	f->samples = p->samples;
+	f->overruns = p->jit.overruns;
+	f->missed = p->jit.missed;
+	f->events = p->cap.events;
+	f->speed = p->flap.speed;
+	f->alarm = p->flap.alarm_active;
+	f->ups = p->flap.ups;
+	f->downs = p->flap.downs;
+	f->speed_changes = p->flap.speed_changes;
+	f->fallbacks = p->flap.fallbacks;
+	f->recoveries = p->flap.recoveries;
+	f->flaps = p->flap.flaps;
+	f->alarms = p->flap.alarms;
+
+	__atomic_store_n(&f->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void link_feed_read_port(const struct link_feed_port *f, struct link_feed_port *copy)
+{
+	uint32_t seq;
+
+	for (;;) {
+		seq = __atomic_load_n(&f->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		memcpy(copy, (const void *)f, sizeof(*copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&f->seq, __ATOMIC_RELAXED) == seq)
+			return;
+	}
+}
+
+/* reference reader: prints the feed once, or every interval_ms */
+static int link_feed_watch(unsigned int interval_ms)
+{
+	const struct link_feed *f;
+	struct link_feed_port copy;
+	int fd, i, k;
+
+	fd = shm_open(feed_name, O_RDONLY, 0);
+	if (fd < 0) {
+		printf("feed: no monitor publishing in %s\n", feed_name);
+		return -1;
+	}
+	f = mmap(NULL, sizeof(*f), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (f == MAP_FAILED) {
+		printf("feed: mmap failed\n");
+		return -1;
+	}
+	if (__atomic_load_n(&f->magic, __ATOMIC_ACQUIRE) != LINK_FEED_MAGIC ||
+	    f->version != LINK_FEED_VERSION || f->size != sizeof(*f)) {
+		printf("feed: %s has an unknown layout\n", feed_name);
+		munmap((void *)f, sizeof(*f));
+		return -1;
+	}
+
+	do {
+		printf("feed: pid %u %s\n", f->pid, __atomic_load_n(&f->running, __ATOMIC_ACQUIRE) ? "running" : "stopped");
+		for (i = 0; i < (int)f->nports && i < MAX_PORTS; i++) {
+			link_feed_read_port(&f->port[i], &copy);
+			printf("usb%u @%llu samples %llu changes %llu overruns %llu missed %llu events %llu",
+				copy.num, (unsigned long long)copy.ts, (unsigned long long)copy.samples,
+				(unsigned long long)copy.changes, (unsigned long long)copy.overruns,
+				(unsigned long long)copy.missed, (unsigned long long)copy.events);
+			printf(" link %s flaps %llu down %llu speed %llu fallback %llu recovery %llu alarms %llu%s:",
+				copy.speed <= SPD_SSP ? link_speed_names[copy.speed] : "?",
+				(unsigned long long)copy.flaps, (unsigned long long)copy.downs,
+				(unsigned long long)copy.speed_changes, (unsigned long long)copy.fallbacks,
+				(unsigned long long)copy.recoveries, (unsigned long long)copy.alarms,
+				copy.alarm ? " ALARM" : "");
+			for (k = 0; k < LF_NUM; k++)
+				printf(" %s=%X(%s)", link_fields[k].name, copy.field[k], link_field_name(k, copy.field[k]));
+			printf("\n");
+		}
+		if (interval_ms)
+			usleep(interval_ms * 1000);
+	} while (interval_ms);
+
+	munmap((void *)f, sizeof(*f));
+	return 0;
+}
+
+static void *usb_map(unsigned int usb_num)
+{
+	static int fd = -1;
+	unsigned int addr;
+	void *base;
+
+	if (usb_num == 1)
+		addr = 0x62320000;
+	else
+		addr = 0x62360000;
+
+	if (fd < 0) {
+		fd = open("/dev/mem", O_RDWR);
+		if (fd < 0) {
+			printf("open /dev/mem fail fd %d\n", fd);
+			return NULL;
+		}
+	}
+
+	base = mmap(NULL, 0x40000, PROT_READ | PROT_WRITE, MAP_SHARED, fd, addr);
+	if (base == MAP_FAILED) {
+		printf("map  fail\n");
+		return NULL;
+	}
+	return base;
+}
+
+static int monitor_add_port(unsigned int num, unsigned int period_us)
+{
+	struct link_port *p;
+	int i;
+
+	if (num != 1 && num != 2) {
+		printf("usb_num %u out of range\n", num);
+		return -1;
+	}
+	for (i = 0; i < nports; i++) {
+		if (ports[i].num == num) {
+			printf("usb%u is already monitored\n", num);
+			return -1;
+		}
+	}
+	if (nports == MAX_PORTS) {
+		printf("At most %d ports can be monitored\n", MAX_PORTS);
+		return -1;
+	}
+	p = &ports[nports];
+	memset(p, 0, sizeof(*p));
+	p->num = num;
+	p->period_us = period_us ? period_us : monitor_period_us;
+	p->base = usb_map(num);
+	if (p->base == NULL)
+		return -1;
+	nports++;
+	return 0;
+}
+
+/* "1,2" or "1:100,2:1000", the optional part being the period in us */
+static int monitor_parse_ports(const char *list)
+{
+	const char *p = list;
+	unsigned int num, period;
+	char *end;
+
+	while (*p) {
+		num = strtoul(p, &end, 10);
+		if (end == p)
+			return -1;
+		period = 0;
+		if (*end == ':') {
+			p = end + 1;
+			period = strtoul(p, &end, 10);
+			if (end == p || period == 0)
+				return -1;
+		}
+		if (monitor_add_port(num, period) < 0)
+			return -1;
+		if (*end == ',')
+			end++;
+		else if (*end != '\0')
+			return -1;
+		p = end;
+	}
+	return nports ? 0 : -1;
+}
+
+/*
+ * Crash-safe trace: every sample is stored in a ring of fixed size records
+ * in a memory mapped file. The header holds the total record count, the
+ * write cursor being head % capacity. The pages live in the page cache,
+ * so a killed process loses nothing, and a slow msync() keeps the file
+ * close to current for a watchdog reboot. Each record carries the low
+ * bits of its own index, so the decoder can drop records that did not
+ * reach the disk together with the header.
+ */
+#define TRACE_MAGIC		0x4C545243	/* "LTRC" */
+#define TRACE_VERSION		1
+#define TRACE_HEADER_SIZE	4096
+#define TRACE_SYNC_S		1
+
+struct trace_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t record_size;
+	uint64_t capacity;	/* records */
+	uint64_t head;		/* records written since start */
+	uint64_t start_monotonic;	/* ns, the sample clock */
+	uint64_t start_realtime;	/* ns, wall clock at the same instant */
+	uint32_t nports;
+	uint32_t port_num[MAX_PORTS];
+	uint32_t period_us[MAX_PORTS];
+};
+
+struct trace_record {
+	struct link_sample s;
+	uint32_t port;
+	uint32_t seq;		/* low 32 bits of the record index */
+};
+
+static const char *trace_path;
+static unsigned int trace_secs = 10;
+static struct trace_header *trace;
+static struct trace_record *trace_rec;
+static size_t trace_len;
+
+static int trace_create(void)
+{
+	struct timespec rt;
+	uint64_t capacity = 0;
+	int fd, i;
+
+	for (i = 0; i < nports; i++)
+		capacity += (uint64_t)trace_secs * 1000000 / ports[i].period_us;
+	if (capacity == 0)
+		capacity = 1;
+	trace_len = TRACE_HEADER_SIZE + capacity * sizeof(struct trace_record);
+
+	fd = open(trace_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perr("trace: open %s failed: %s\n", trace_path, strerror(errno));
+		return -1;
+	}
+	if (ftruncate(fd, trace_len) < 0) {
+		perr("trace: ftruncate failed: %s\n", strerror(errno));
+		close(fd);
+		return -1;
+	}
+	trace = mmap(NULL, trace_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (trace == MAP_FAILED) {
+		trace = NULL;
+		perr("trace: mmap failed: %s\n", strerror(errno));
+		return -1;
+	}
+	trace_rec = (struct trace_record *)((char *)trace + TRACE_HEADER_SIZE);
+
+	trace->version = TRACE_VERSION;
+	trace->header_size = TRACE_HEADER_SIZE;
+	trace->record_size = sizeof(struct trace_record);
+	trace->capacity = capacity;
+	trace->head = 0;
+	clock_gettime(CLOCK_REALTIME, &rt);
+	trace->start_monotonic = now_ns();
+	trace->start_realtime = (uint64_t)rt.tv_sec * 1000000000ull + rt.tv_nsec;
+	trace->nports = nports;
+	for (i = 0; i < nports; i++) {
+		trace->port_num[i] = ports[i].num;
+		trace->period_us[i] = ports[i].period_us;
+	}
+	__atomic_store_n(&trace->magic, TRACE_MAGIC, __ATOMIC_RELEASE);
+	msync(trace, TRACE_HEADER_SIZE, MS_SYNC);
+	printf("trace: %s, %llu records (%u s), %zu bytes\n", trace_path,
+		(unsigned long long)capacity, trace_secs, trace_len);
+	return 0;
+}
+
+static inline void trace_put(int port, const struct link_sample *s)
+{
+	uint64_t head = trace->head;
+	struct trace_record *r = &trace_rec[head % trace->capacity];
+
+	r->s = *s;
+	r->port = port;
+	r->seq = (uint32_t)head;
+	__atomic_store_n(&trace->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void trace_sync(int flags)
+{
+	if (trace)
+		msync(trace, trace_len, flags);
+}
+
+static void trace_close(void)
+{
+	if (trace == NULL)
+		return;
+	trace_sync(MS_SYNC);
+	munmap(trace, trace_len);
+	trace = NULL;
+}
+
+/* prints the records still in the ring, oldest first */
+static int trace_decode(const char *path)
+{
+	const struct trace_header *h;
+	const struct trace_record *rec, *r;
+	uint64_t i, first, dropped = 0;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		printf("trace: open %s failed\n", path);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		printf("trace: mmap %s failed\n", path);
+		return -1;
+	}
+	h = map;
+	if ((size_t)st.st_size < TRACE_HEADER_SIZE || h->magic != TRACE_MAGIC || h->version != TRACE_VERSION ||
+	    h->record_size != sizeof(struct trace_record) || h->nports > MAX_PORTS ||
+	    (uint64_t)st.st_size < h->header_size + h->capacity * h->record_size) {
+		printf("trace: %s is not a link trace\n", path);
+		munmap(map, st.st_size);
+		return -1;
+	}
+	rec = (const struct trace_record *)((const char *)map + h->header_size);
+	first = h->head > h->capacity ? h->head - h->capacity : 0;
+
+	printf("# trace %s: %llu records written, %llu kept, start realtime %llu monotonic %llu\n", path,
+		(unsigned long long)h->head, (unsigned long long)(h->head - first),
+		(unsigned long long)h->start_realtime, (unsigned long long)h->start_monotonic);
+	for (i = 0; i < h->nports; i++)
+		printf("# usb%u period %u us\n", h->port_num[i], h->period_us[i]);
+	for (i = first; i < h->head; i++) {
+		r = &rec[i % h->capacity];
+		if (r->seq != (uint32_t)i || r->port >= h->nports) {
+			dropped++;
+			continue;
+		}
+		printf("usb%u ", h->port_num[r->port]);
+		link_capture_write(stdout, &r->s);
+	}
+	if (dropped)
+		printf("# %llu torn record(s) skipped\n", (unsigned long long)dropped);
+	munmap(map, st.st_size);
+	return 0;
+}
+
+/*
+ * Write/reaction timeline: test pattern writes are queued by the test
+ * setup and issued from the monitor loop once a baseline has been
+ * sampled, so writes and samples share one clock. Each write remembers
+ * the sample before it and the first sample where LTSSM and DSTS (or
+ * PORTSC in host mode) differ gives the reaction latency, to within one
+ * sample period.
+ */
+#define MAX_WRITES		16
+#define MAX_TIMELINE		256
+#define TIMELINE_BASELINE	16		/* samples before the first write */
+#define TIMELINE_TIMEOUT	1000000000ull	/* stop waiting for a reaction, ns */
+
+struct link_write {
+	int port;
+	uint32_t off;
+	unsigned int startbit;
+	unsigned int width;
+	unsigned int val;
+	unsigned int pattern;
+	uint64_t ts;		/* 0 while queued */
+	struct link_sample before;
+	uint64_t ltssm_ts;	/* first LTSSM change, 0 while pending */
+	uint64_t status_ts;	/* first DSTS/PORTSC change, 0 while pending */
+	bool done;
+};
+
+struct timeline_entry {
+	uint64_t ts;
+	int port;
+	int write;		/* index in writes[], -1 for a link change */
+	struct link_sample s;
+};
+
+static struct link_write writes[MAX_WRITES];
+static int nwrites;
+static int writes_pending;	/* issued and still waiting for a reaction */
+static struct timeline_entry timeline[MAX_TIMELINE];
+static int ntimeline;
+
+static const char *reg_name(uint32_t off)
+{
+	switch (off) {
+	case 0x20:	return "USBCMD";
+	case 0x424:	return "PORTPMSC_U2";
+	case 0x430:	return "PORTSC_U3";
+	case 0xC2C0:	return "GUSB3PIPECTL";
+	case 0xC704:	return "DCTL";
+	default:	return "REG";
+	}
+}
+
+static bool port_is_device(const struct link_port *p)
+{
+	return ((p->gctl >> 12) & 0x3) == 0x2;
+}
+
+static void timeline_add(uint64_t ts, int port, int write, const struct link_sample *s)
+{
+	struct timeline_entry *e;
+
+	if (ntimeline == MAX_TIMELINE)
+		return;
+	e = &timeline[ntimeline++];
+	e->ts = ts;
+	e->port = port;
+	e->write = write;
+	e->s = *s;
+}
+
+static int timeline_queue_write(int port, uint32_t off, unsigned int startbit, unsigned int width,
+				unsigned int val, unsigned int pattern)
+{
+	struct link_write *w;
+
+	if (nwrites == MAX_WRITES) {
+		printf("timeline: too many queued writes\n");
+		return -1;
+	}
+	w = &writes[nwrites++];
+	memset(w, 0, sizeof(*w));
+	w->port = port;
+	w->off = off;
+	w->startbit = startbit;
+	w->width = width;
+	w->val = val;
+	w->pattern = pattern;
+	return 0;
+}
+
+static void timeline_issue_writes(struct link_port *p, int port)
+{
+	struct link_write *w;
+	int i;
+
+	for (i = 0; i < nwrites; i++) {
+		w = &writes[i];
+		if (w->port != port || w->ts)
+			continue;
+		RMWREG32(p->base + w->off, w->startbit, w->width, w->val);
+		w->ts = now_ns();
+		w->before = p->last;
+		writes_pending++;
+		timeline_add(w->ts, port, i, &p->last);
+	}
+}
+
+static void timeline_check(struct link_port *p, int port, const struct link_sample *s)
+{
+	bool status_changed;
+	struct link_write *w;
+	int i;
+
+	if (port_is_device(p))
+		status_changed = s->dsts != p->last.dsts;
+	else
+		status_changed = s->portsc_u2 != p->last.portsc_u2 || s->portsc_u3 != p->last.portsc_u3;
+	if (status_changed || s->ltssm != p->last.ltssm)
+		timeline_add(s->ts, port, -1, s);
+
+	if (writes_pending == 0)
+		return;
+	for (i = 0; i < nwrites; i++) {
+		w = &writes[i];
+		if (w->port != port || w->ts == 0 || w->done)
+			continue;
+		if (w->ltssm_ts == 0 && s->ltssm != w->before.ltssm)
+			w->ltssm_ts = s->ts;
+		if (w->status_ts == 0 &&
+		    (port_is_device(p) ? s->dsts != w->before.dsts :
+		     s->portsc_u2 != w->before.portsc_u2 || s->portsc_u3 != w->before.portsc_u3))
+			w->status_ts = s->ts;
+		if ((w->ltssm_ts && w->status_ts) || s->ts - w->ts > TIMELINE_TIMEOUT) {
+			w->done = true;
+			writes_pending--;
+		}
+	}
+}
+
+static void timeline_print_latency(FILE *out, const char *what, uint64_t from, uint64_t to)
+{
+	if (to)
+		fprintf(out, ", %s after %.1f us", what, (to - from) / 1000.0);
+	else
+		fprintf(out, ", %s no reaction", what);
+}
+
+static void timeline_report(FILE *out)
+{
+	const struct timeline_entry *e;
+	const struct link_write *w;
+	int i;
+
+	if (nwrites == 0)
+		return;
+	fprintf(out, "timeline: write to reaction latency, resolution one sample period\n");
+	for (i = 0; i < nwrites; i++) {
+		w = &writes[i];
+		fprintf(out, "  usb%u pattern %u %s[%u:%u]=%X", ports[w->port].num, w->pattern, reg_name(w->off),
+			w->startbit + w->width - 1, w->startbit, w->val);
+		if (w->ts == 0) {
+			fprintf(out, " not issued\n");
+			continue;
+		}
+		timeline_print_latency(out, "LTSSM", w->ts, w->ltssm_ts);
+		timeline_print_latency(out, port_is_device(&ports[w->port]) ? "DSTS" : "PORTSC", w->ts, w->status_ts);
+		fprintf(out, "\n");
+	}
+
+	fprintf(out, "timeline: %d entries%s\n", ntimeline, ntimeline == MAX_TIMELINE ? " (full)" : "");
+	for (i = 0; i < ntimeline; i++) {
+		e = &timeline[i];
+		if (e->write >= 0) {
+			w = &writes[e->write];
+			fprintf(out, "  %llu usb%u write %s[%u:%u]=%X\n", (unsigned long long)e->ts, ports[e->port].num,
+				reg_name(w->off), w->startbit + w->width - 1, w->startbit, w->val);
+		} else {
+			fprintf(out, "  %llu usb%u LTSSM %08X (%s) DSTS %08X PORTSC_U2 %08X PORTSC_U3 %08X\n",
+				(unsigned long long)e->ts, ports[e->port].num, e->s.ltssm,
+				link_field_name(LF_LTSSM_LINK, link_field_get(&e->s, LF_LTSSM_LINK)),
+				e->s.dsts, e->s.portsc_u2, e->s.portsc_u3);
+		}
+	}
+}
+
+/*
+ * The sampler skips GCTL on every tick; it is re-read at a slow rate so
+ * samples carry a current value and a role switch (PRTCAPDIR) picks the
+ * matching sampler again.
+ */
+#define GCTL_RECHECK_NS		100000000ull
+
+static void monitor_select_sampler(struct link_port *p)
+{
+	unsigned int opmode;
+	int i;
+
+	p->gctl = readl(p->base + USB_GCTL);
+	opmode = (p->gctl >> 12) & 0x3;
+	if (opmode == 0x1)
+		p->sample = link_sample_host;
+	else if (opmode == 0x2)
+		p->sample = link_sample_device;
+	else
+		p->sample = link_sample_all;
+	printf("usb%u: %s mode sampler\n", p->num, opmode == 0x1 ? "host" : opmode == 0x2 ? "device" : "full");
+
+	for (i = 0; i < capture_cfg.ntrig; i++)
+		if (!link_field_sampled(capture_cfg.trig[i].field, opmode))
+			printf("usb%u: trigger %s uses a register not sampled in this mode\n",
+				p->num, capture_cfg.trig[i].expr);
+}
+
+static void monitor_sample(struct link_port *p, uint64_t ts, uint64_t expirations)
+{
+	struct link_sample s = { .ts = ts };
+
+	if (ts - p->gctl_ts >= GCTL_RECHECK_NS) {
+		uint32_t gctl = readl(p->base + USB_GCTL);
+
+		p->gctl_ts = ts;
+		if ((gctl ^ p->gctl) & (0x3 << 12)) {
+			printf("usb%u: GCTL %08X -> %08X, port role changed\n", p->num, p->gctl, gctl);
+			monitor_select_sampler(p);
+		} else {
+			p->gctl = gctl;
+		}
+	}
+	s.gctl = p->gctl;
+	p->sample(p->base, &s);
+	p->samples++;
+	jitter_add(&p->jit, ts, expirations);
+	if (expirations > 1 && p->cap.ntrig)
+		link_capture_gap(&p->cap, ts, expirations - 1);
+	link_flap_update(&p->flap, p->num, &s);
+
+	if (p->cap.ntrig) {
+		link_capture_feed(&p->cap, &s);
+	} else if (!monitor_quiet) {
+		if (nports > 1)
+			printf("usb%u @%llu\n", p->num, (unsigned long long)ts);
+		link_sample_print(&s);
+	}
+	if (p->feed)
+		link_feed_publish(p, &s);
+	if (trace)
+		trace_put(p - ports, &s);
+
+	if (nwrites) {
+		if (p->samples > 1)
+			timeline_check(p, p - ports, &s);
+		p->last = s;
+		if (p->samples == TIMELINE_BASELINE)
+			timeline_issue_writes(p, p - ports);
+	}
+}
+
+/*
+ * Metrics: a slow timer in the monitor loop renders the counters the
+ * sampler already keeps in Prometheus text format, to a temporary file
+ * renamed over the target (node_exporter textfile collector style). The
+ * sample path itself is untouched.
+ */
+static const char *metrics_path;
+static unsigned int metrics_interval_s = 10;
+
+static void metrics_head(FILE *out, const char *name, const char *type, const char *help)
+{
+	fprintf(out, "# HELP th_usb_%s %s\n# TYPE th_usb_%s %s\n", name, help, name, type);
+}
+
+static void metrics_port_u64(FILE *out, const char *name, size_t off)
+{
+	int i;
+
+	for (i = 0; i < nports; i++)
+		fprintf(out, "th_usb_%s{usb=\"%u\"} %llu\n", name, ports[i].num,
+			(unsigned long long)*(const uint64_t *)((const char *)&ports[i] + off));
+}
+
+static int metrics_write(void)
+{
+	static const struct {
+		const char *name;
+		const char *help;
+		size_t off;
+	} counters[] = {
+		{ "samples_total", "Link state samples taken", offsetof(struct link_port, samples) },
+		{ "sample_overruns_total", "Timer wakeups that found missed ticks", offsetof(struct link_port, jit.overruns) },
+		{ "samples_missed_total", "Samples lost to sampler overruns", offsetof(struct link_port, jit.missed) },
+		{ "capture_events_total", "Capture triggers fired", offsetof(struct link_port, cap.events) },
+		{ "link_flaps_total", "Link drops and speed changes while up", offsetof(struct link_port, flap.flaps) },
+		{ "link_ups_total", "Link came up", offsetof(struct link_port, flap.ups) },
+		{ "link_downs_total", "Link went down", offsetof(struct link_port, flap.downs) },
+		{ "link_speed_changes_total", "Link speed changed while up", offsetof(struct link_port, flap.speed_changes) },
+		{ "link_ss_fallbacks_total", "SuperSpeed lost, link kept at USB2 speed", offsetof(struct link_port, flap.fallbacks) },
+		{ "link_recoveries_total", "LTSSM entered Recovery", offsetof(struct link_port, flap.recoveries) },
+		{ "link_flap_alarms_total", "Flap rate alarms raised", offsetof(struct link_port, flap.alarms) },
+	};
+	static const struct {
+		const char *name;
+		const char *help;
+		unsigned int permille;
+	} intervals[] = {
+		{ "sample_interval_p50_seconds", "Sampler inter-sample interval median since start", 500 },
+		{ "sample_interval_p99_seconds", "Sampler inter-sample interval 99th percentile since start", 990 },
+		{ "sample_interval_max_seconds", "Sampler inter-sample interval maximum since start", 1000 },
+	};
+	char tmp[PATH_MAX];
+	struct link_port *p;
+	uint64_t cur;
+	unsigned int k;
+	FILE *out;
+	int i;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", metrics_path);
+	out = fopen(tmp, "w");
+	if (out == NULL) {
+		perr("metrics: open %s failed: %s\n", tmp, strerror(errno));
+		return -1;
+	}
+
+	for (k = 0; k < sizeof(counters) / sizeof(counters[0]); k++) {
+		metrics_head(out, counters[k].name, "counter", counters[k].help);
+		metrics_port_u64(out, counters[k].name, counters[k].off);
+	}
+
+	for (k = 0; k < sizeof(intervals) / sizeof(intervals[0]); k++) {
+		metrics_head(out, intervals[k].name, "gauge", intervals[k].help);
+		for (i = 0; i < nports; i++) {
+			p = &ports[i];
+			fprintf(out, "th_usb_%s{usb=\"%u\"} %.9f\n", intervals[k].name, p->num,
+				(intervals[k].permille < 1000 ? jitter_percentile(&p->jit, intervals[k].permille) : p->jit.max) / 1e9);
+		}
+	}
+
+	metrics_head(out, "link_speed", "gauge", "Current link speed, 0 down 1 LS 2 FS 3 HS 4 SS 5 SSP");
+	for (i = 0; i < nports; i++)
+		fprintf(out, "th_usb_link_speed{usb=\"%u\"} %u\n", ports[i].num, ports[i].flap.speed);
+	metrics_head(out, "link_flap_alarm", "gauge", "Flap rate alarm currently active");
+	for (i = 0; i < nports; i++)
+		fprintf(out, "th_usb_link_flap_alarm{usb=\"%u\"} %d\n", ports[i].num, ports[i].flap.alarm_active);
+
+	metrics_head(out, "ltssm_state_seconds_total", "counter", "Time spent in each LTSSM link state");
+	for (i = 0; i < nports; i++) {
+		p = &ports[i];
+		if (!p->flap.valid)
+			continue;
+		for (k = 0; k < 16; k++) {
+			cur = p->flap.residency[k];
+			if (k == p->flap.ltssm_link)
+				cur += p->jit.last_ts - p->flap.state_since;
+			if (cur == 0)
+				continue;
+			fprintf(out, "th_usb_ltssm_state_seconds_total{usb=\"%u\",code=\"%u\",state=\"%s\"} %.6f\n",
+				p->num, k, link_field_name(LF_LTSSM_LINK, k), cur / 1e9);
+		}
+	}
+
+	metrics_head(out, "init_duration_seconds", "gauge", "Time taken by usb_init() for this controller");
+	for (i = 0; i < nports; i++)
+		if (ports[i].init_ns)
+			fprintf(out, "th_usb_init_duration_seconds{usb=\"%u\"} %.6f\n", ports[i].num, ports[i].init_ns / 1e9);
+
+	metrics_head(out, "phy_tune", "gauge", "PHY tuning register written by usb_init(), labelled with its fields");
+	for (i = 0; i < nports; i++) {
+		p = &ports[i];
+		if (p->tuned)
+			fprintf(out, "th_usb_phy_tune{usb=\"%u\",regs1=\"%u\",regs2=\"%u\",regs3=\"%u\"} %u\n",
+				p->num, p->tune[0], p->tune[1], p->tune[2],
+				PHY_NCR_REG_MASK | (p->tune[0]<<6 | p->tune[1]<<11 | p->tune[2]<<13));
+	}
+
+	if (fclose(out) != 0 || rename(tmp, metrics_path) < 0) {
+		perr("metrics: write %s failed: %s\n", metrics_path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* epoll tags beyond the timer indexes */
+#define MONITOR_EV_SIGNAL	MAX_PORTS
+#define MONITOR_EV_METRICS	(MAX_PORTS + 1)
+#define MONITOR_EV_TRACE	(MAX_PORTS + 2)
+
+static int monitor_run(void)
+{
+	struct link_timer timers[MAX_PORTS];
+	struct epoll_event ev, events[MAX_PORTS + 3];
+	struct signalfd_siginfo si;
+	struct itimerspec its;
+	sigset_t mask;
+	uint64_t start, ts, expirations;
+	int ntimers = 0;
+	int epfd, sfd, mfd = -1, tfd = -1, i, j, k, n, ret = 0;
+	bool running = true;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (sfd < 0 || epfd < 0) {
+		perr("monitor: signalfd/epoll failed: %s\n", strerror(errno));
+		return -1;
+	}
+	ev.events = EPOLLIN;
+	ev.data.u32 = MONITOR_EV_SIGNAL;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, sfd, &ev);
+
+	for (i = 0; i < nports; i++) {
+		monitor_select_sampler(&ports[i]);
+		if (capture_cfg.ntrig) {
+			ports[i].cap = capture_cfg;
+			ports[i].cap.num = ports[i].num;
+			ports[i].cap.period_us = ports[i].period_us;
+			ports[i].cap.jit = &ports[i].jit;
+			if (nports > 1)
+				snprintf(ports[i].cap_path, sizeof(ports[i].cap_path), "%s.usb%u", capture_cfg.path, ports[i].num);
+			else
+				snprintf(ports[i].cap_path, sizeof(ports[i].cap_path), "%s", capture_cfg.path);
+			if (link_capture_init(&ports[i].cap, ports[i].cap_path) < 0) {
+				ret = -1;
+				goto out;
+			}
+		}
+		for (j = 0; j < ntimers; j++)
+			if (timers[j].period_us == ports[i].period_us)
+				break;
+		if (j == ntimers) {
+			timers[j].fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+			if (timers[j].fd < 0) {
+				perr("monitor: timerfd_create failed: %s\n", strerror(errno));
+				ret = -1;
+				goto out;
+			}
+			timers[j].period_us = ports[i].period_us;
+			timers[j].nport = 0;
+			ev.events = EPOLLIN;
+			ev.data.u32 = j;
+			epoll_ctl(epfd, EPOLL_CTL_ADD, timers[j].fd, &ev);
+			ntimers++;
+		}
+		timers[j].port[timers[j].nport++] = i;
+	}
+
+	if (feed_name && link_feed_create() < 0) {
+		ret = -1;
+		goto out;
+	}
+	if (trace_path) {
+		if (trace_create() < 0) {
+			ret = -1;
+			goto out;
+		}
+		tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+		if (tfd >= 0) {
+			its.it_value.tv_sec = TRACE_SYNC_S;
+			its.it_value.tv_nsec = 0;
+			its.it_interval = its.it_value;
+			timerfd_settime(tfd, 0, &its, NULL);
+			ev.events = EPOLLIN;
+			ev.data.u32 = MONITOR_EV_TRACE;
+			epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev);
+		}
+	}
+
+	/* common start instant, 1 ms ahead so every timer is armed in time */
+	start = now_ns() + 1000000;
+	for (j = 0; j < ntimers; j++) {
+		its.it_value.tv_sec = start / 1000000000ull;
+		its.it_value.tv_nsec = start % 1000000000ull;
+		its.it_interval.tv_sec = timers[j].period_us / 1000000;
+		its.it_interval.tv_nsec = (timers[j].period_us % 1000000) * 1000;
+		timerfd_settime(timers[j].fd, TFD_TIMER_ABSTIME, &its, NULL);
+		printf("monitor: timer %d period %u us, %d port(s)\n", j, timers[j].period_us, timers[j].nport);
+	}
+
+	if (metrics_path) {
+		mfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+		if (mfd < 0) {
+			perr("metrics: timerfd_create failed: %s\n", strerror(errno));
+			ret = -1;
+			goto out;
+		}
+		its.it_value.tv_sec = metrics_interval_s;
+		its.it_value.tv_nsec = 0;
+		its.it_interval = its.it_value;
+		timerfd_settime(mfd, 0, &its, NULL);
+		ev.events = EPOLLIN;
+		ev.data.u32 = MONITOR_EV_METRICS;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, mfd, &ev);
+		printf("metrics: %s every %u s\n", metrics_path, metrics_interval_s);
+	}
+
+	while (running) {
+		n = epoll_wait(epfd, events, MAX_PORTS + 3, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perr("monitor: epoll_wait failed: %s\n", strerror(errno));
+			ret = -1;
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			j = events[i].data.u32;
+			if (j == MONITOR_EV_SIGNAL) {
+				if (read(sfd, &si, sizeof(si)) == sizeof(si))
+					printf("monitor: signal %u, stopping\n", si.ssi_signo);
+				running = false;
+				continue;
+			}
+			if (j == MONITOR_EV_TRACE) {
+				if (read(tfd, &expirations, sizeof(expirations)) == sizeof(expirations))
+					trace_sync(MS_ASYNC);
+				continue;
+			}
+			if (j == MONITOR_EV_METRICS) {
+				if (read(mfd, &expirations, sizeof(expirations)) == sizeof(expirations))
+					metrics_write();
+				continue;
+			}
+			if (read(timers[j].fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+				continue;
+			ts = now_ns();
+			for (k = 0; k < timers[j].nport; k++)
+				monitor_sample(&ports[timers[j].port[k]], ts, expirations);
+		}
+	}
+
+out:
+	for (i = 0; i < nports; i++) {
+		printf("usb%u: %llu samples\n", ports[i].num, (unsigned long long)ports[i].samples);
+		jitter_report(stdout, "", ports[i].num, ports[i].period_us, &ports[i].jit);
+		link_flap_report(stdout, ports[i].num, &ports[i].flap);
+		link_capture_close(&ports[i].cap);
+	}
+	timeline_report(stdout);
+	if (mfd >= 0) {
+		metrics_write();
+		close(mfd);
+	}
+	if (tfd >= 0)
+		close(tfd);
+	trace_close();
+	link_feed_close();
+	for (j = 0; j < ntimers; j++)
+		close(timers[j].fd);
+	close(epfd);
+	close(sfd);
+	return ret;
+}
+
+static int usb_init(int phy_num, void *base, int usb_mode, int usb_speed, int regs1, int regs2, int regs3)
+{
+	void *phybase = base+0x20000;
+	unsigned int data;
+	int i;
+
+	/* use internal phy clock and reset usb phy, reset high effective */
+	data = readl(phybase + USB_PHY_NCR_CTRL0);
+	data &= ~(1<<18);
+	data |= (1<<0);
+	writel(data, phybase + USB_PHY_NCR_CTRL0);
+
+	if (phy_num == 1) {
+//		enable_clk(1, 0, 0);
+//		enable_clk(1, 1, 1);
+		printf("\033[31musb phy 1 internal clk\033[00m\n");
+		writel(0x41000005, phybase + USB_PHY_NCR_CTRL0);
+		writel(0x69254000, phybase + USB_PHY_NCR_CTRL1);
+		writel(0x0E2C7878, phybase + USB_PHY_NCR_CTRL2);
+		writel(0x3E700800, phybase + USB_PHY_NCR_CTRL3);
+		writel(PHY_NCR_REG_MASK | (regs1<<6 | regs2<<11 | regs3<<13), phybase + USB_PHY_NCR_CTRL4);
+		writel(0x00000000, phybase + USB_PHY_NCR_CTRL5);
+		writel(0x00000001, phybase + USB_PHY_NCR_CTRL6);
+		writel(0x00000000, phybase + USB_PHY_NCR_CTRL7);
+	} else if (phy_num == 2) {
+//		enable_clk(2, 0, 0);
+//		enable_clk(2, 1, 1);
+		printf("\033[31musb phy 2 internal clk\033[00m\n");
+		writel(0x41000005, phybase + USB_PHY_NCR_CTRL0);
+		writel(0x69254000, phybase + USB_PHY_NCR_CTRL1);
+		writel(0x0E2C7878, phybase + USB_PHY_NCR_CTRL2);
+		writel(0x3E700800, phybase + USB_PHY_NCR_CTRL3);
+		writel(PHY_NCR_REG_MASK | (regs1<<6 | regs2<<11 | regs3<<13), phybase + USB_PHY_NCR_CTRL4);
+		writel(0x00000000, phybase + USB_PHY_NCR_CTRL5);
+		writel(0x00000001, phybase + USB_PHY_NCR_CTRL6);
+		writel(0x00000000, phybase + USB_PHY_NCR_CTRL7);
+	}
+
+	if (1) {
+		printf("\033[31musb init ctrl ncr\033[00m\n");
+		writel(0x00000003, base + USB_CTRL_NCR_INTE);
+		writel(0x00210080, base + USB_CTRL_NCR_CTRL0);
+		writel(0x00000000, base + USB_CTRL_NCR_CTRL1);
+		writel(0x00000000, base + USB_CTRL_NCR_CTRL2);
+		writel(0x00000000, base + USB_CTRL_NCR_CTRL3);
+		writel(0x00000000, base + USB_CTRL_NCR_CTRL4);
+		writel(0x00000000, base + USB_CTRL_NCR_CTRL5);
+		writel(0x00000000, base + USB_CTRL_NCR_CTRL6);
+		writel(0x00000000, base + USB_CTRL_NCR_CTRL7);
+		
+		// GUSB3PIPECTL
+		writel(0x010C0002, base + 0xC2C0);
+	}
+	usleep(30);
+
+	// phy reset
+	data = readl(phybase + USB_PHY_NCR_CTRL0);
+	data &= ~(1<<0);
+	writel(data, phybase + USB_PHY_NCR_CTRL0);
+
+	if (usb_mode == 1) { //Device
+		printf("\033[31musb set Device mode\033[00m\n");
+		// set Device mode
+		data = readl(base + 0xc110);
+		data &= ~(0x3<<12);
+		data |= (0x2<<12);
+		writel(data, base + 0xC110);
+
+		// set speed
+		data = readl(base + 0xc700);
+		data &= ~(0x7);
+		if (usb_speed == 1) {
+			data |= 1; //full
+		} else if (usb_speed == 2) {
+			data |= 0; // high
+		} else if (usb_speed == 3) {
+			data |= 4; // super
+		}
+		writel(data, base + 0xC700);
+
+		// set bit 30
+		data = readl(base + 0xc704);
+		data |= (0x1<<30);
+		writel(data, base + 0xC704);
+		usleep(5);
+		i = 1000;
+		while (i--)
+			if ((readl(base + 0xc704) & (1<<30)) == 0)
+				break;
+		if (i==0)
+			printf("read 0x24 timeout\n");
+
+		usleep(50);
+	} else if (usb_mode == 2) { // Host
+		printf("\033[31musb set Host mode\033[00m\n");
+		// set host mode
+		data = readl(base + 0xc110);
+		data &= ~(0x3<<12);
+		data |= (0x1<<12);
+		writel(data, base + 0xC110);
+		i = 1000;
+		while (i--)
+			if ((readl(base + 0x24) & (1<<11)) == 0)
+				break;
+		if (i==0)
+			printf("read 0x24 timeout\n");
+
+		data = readl(base + 0xc110);
+		data |= (0x1<<11);
+		writel(data, base + 0xC110);
+		i = 1000;
+		while (i--)
+			if ((readl(base + 0xc110) & (1<<11)) == 0)
+				break;
+		if (i==0)
+			printf("read 0xc110 timeout\n");
+
+		usleep(500);
+	
+		data = readl(base + 0xc110);
+		data &= ~(0x1<<11);
+		writel(data, base + 0xC110);
+	
+		writel(0x2a0, base + 0x420);
+		writel(0x2a0, base + 0x430);
+	}
+
+	printf("init ok\n");
+	return 0;
+}
+
+/*
+ * Hub requests are submitted asynchronously and completed from
+ * libusb_handle_events, so all requests of one step are in flight at
+ * once. A batch counts its outstanding transfers and each request
+ * reports its length or libusb error through *result.
+ */
+struct hub_batch {
+	libusb_context *ctx;
+	int pending;
+	int failed;
+};
+
+struct hub_req {
+	struct hub_batch *batch;
+	uint8_t *data;		/* IN data is copied here */
+	int *result;
+	libusb_device_handle *handle;
+	int kind;
+	uint64_t submit_ns;
+};
+
+/*
+ * Every hub request is timed from submit to completion into a latency
+ * histogram per request kind; hubs that are slow to ACK show up in the
+ * report at exit without a bus analyzer.
+ */
+enum hub_req_kind {
+	HUB_RQ_DESC,
+	HUB_RQ_SUSPEND,
+	HUB_RQ_RESUME,
+	HUB_RQ_PORT_TEST,
+	HUB_RQ_LINK_STATE,
+	HUB_RQ_BH_RESET,
+	HUB_RQ_TEST_MODE,
+	HUB_RQ_OTHER,
+	HUB_RQ_NUM,
+};
+
+static const char *const hub_rq_names[HUB_RQ_NUM] = {
+	"get_hub_desc", "suspend", "resume", "port_test", "link_state", "bh_reset", "test_mode", "other",
+};
+
+struct hub_rq_stats {
+	struct link_jitter lat;
+	uint64_t timeouts;
+	uint64_t errors;
+};
+
+static __thread struct hub_rq_stats hub_rq_stats[HUB_RQ_NUM];
+
+/* per hub accounting, in the hub table below */
+static void hub_note_xfer(libusb_device_handle *handle, uint64_t ns, int r);
+
+static int hub_req_kind(uint8_t type, uint8_t request, uint16_t value)
+{
+	if (request == LIBUSB_REQUEST_GET_DESCRIPTOR)
+		return HUB_RQ_DESC;
+	if ((type & 0x1f) == LIBUSB_RECIPIENT_DEVICE)
+		return request == LIBUSB_REQUEST_SET_FEATURE && value == USB_DEVICE_TEST_MODE ? HUB_RQ_TEST_MODE : HUB_RQ_OTHER;
+	if (request == LIBUSB_REQUEST_CLEAR_FEATURE)
+		return value == USB_PORT_FEAT_SUSPEND ? HUB_RQ_RESUME : HUB_RQ_OTHER;
+	switch (value) {
+	case USB_PORT_FEAT_SUSPEND:
+		return HUB_RQ_SUSPEND;
+	case USB_PORT_FEAT_TEST:
+		return HUB_RQ_PORT_TEST;
+	case USB_PORT_FEAT_LINK_STATE:
+		return HUB_RQ_LINK_STATE;
+	case USB_PORT_FEAT_BH_RESET:
+		return HUB_RQ_BH_RESET;
+	default:
+		return HUB_RQ_OTHER;
+	}
+}
+
+static int hub_xfer_status(const struct libusb_transfer *xfer)
+{
+	switch (xfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return xfer->actual_length;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_STALL:
+		return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case LIBUSB_TRANSFER_CANCELLED:
+		return LIBUSB_ERROR_INTERRUPTED;
+	default:
+		return LIBUSB_ERROR_IO;
+	}
+}
+
+static void LIBUSB_CALL hub_req_cb(struct libusb_transfer *xfer)
+{
+	struct hub_req *req = xfer->user_data;
+	struct hub_rq_stats *st = &hub_rq_stats[req->kind];
+	int r = hub_xfer_status(xfer);
+	uint64_t ns = now_ns() - req->submit_ns;
+
+	jitter_hist_add(&st->lat, ns);
+	if (r == LIBUSB_ERROR_TIMEOUT)
+		st->timeouts++;
+	else if (r < 0)
+		st->errors++;
+	hub_note_xfer(req->handle, ns, r);
+
+	if (r > 0 && req->data)
+		memcpy(req->data, libusb_control_transfer_get_data(xfer), r);
+	if (req->result)
+		*req->result = r;
+	if (r < 0)
+		req->batch->failed++;
+	req->batch->pending--;
+	free(req);
+}
+
+static int hub_submit(struct hub_batch *b, libusb_device_handle *handle, uint8_t type, uint8_t request,
+		      uint16_t value, uint16_t index, uint8_t *data, uint16_t len, unsigned int timeout, int *result)
+{
+	struct libusb_transfer *xfer;
+	struct hub_req *req;
+	unsigned char *buf;
+	int r;
+
+	xfer = libusb_alloc_transfer(0);
+	buf = malloc(LIBUSB_CONTROL_SETUP_SIZE + len);
+	req = malloc(sizeof(*req));
+	if (xfer == NULL || buf == NULL || req == NULL) {
+		r = LIBUSB_ERROR_NO_MEM;
+		goto fail;
+	}
+	libusb_fill_control_setup(buf, type, request, value, index, len);
+	if (!(type & LIBUSB_ENDPOINT_IN) && len)
+		memcpy(buf + LIBUSB_CONTROL_SETUP_SIZE, data, len);
+	req->batch = b;
+	req->data = (type & LIBUSB_ENDPOINT_IN) ? data : NULL;
+	req->result = result;
+	req->handle = handle;
+	req->kind = hub_req_kind(type, request, value);
+	libusb_fill_control_transfer(xfer, handle, buf, hub_req_cb, req, timeout);
+	xfer->flags = LIBUSB_TRANSFER_FREE_BUFFER | LIBUSB_TRANSFER_FREE_TRANSFER;
+
+	req->submit_ns = now_ns();
+	r = libusb_submit_transfer(xfer);
+	if (r < 0) {
+		xfer->flags = 0;
+		goto fail;
+	}
+	b->pending++;
+	return 0;
+
+fail:
+	libusb_free_transfer(xfer);
+	free(buf);
+	free(req);
+	if (result)
+		*result = r;
+	b->failed++;
+	hub_rq_stats[hub_req_kind(type, request, value)].errors++;
+	return r;
+}
+
+/* returns the number of failed requests of the batch, or a libusb error */
+static int hub_batch_wait(struct hub_batch *b)
+{
+	int r;
+
+	while (b->pending > 0) {
+		r = libusb_handle_events_completed(b->ctx, NULL);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+			perr("handle events failed: %s\n", libusb_error_name(r));
+			return r;
+		}
+	}
+	r = b->failed;
+	b->failed = 0;
+	return r;
+}
+
+/*
+ * Idle wait: libusb's pollfds and a signalfd for SIGINT/SIGTERM share one
+ * poll(), so a running test sleeps until libusb has work or the operator
+ * stops it. idle() is called after every round of event handling.
+ * Returns 1 when stopped by a signal, 0 when timeout_ms (-1: none) ran out.
+ * With workers the main thread takes the signals and sets hub_stop_fd,
+ * which every worker loop polls in place of its own signalfd.
+ */
+#define HUB_MAX_POLLFDS		32
+
+static int hub_stop_fd = -1;
+
+static int hub_event_loop(libusb_context *ctx, void (*idle)(libusb_context *ctx), int timeout_ms)
+{
+	const struct libusb_pollfd **lfds;
+	struct pollfd fds[HUB_MAX_POLLFDS];
+	struct signalfd_siginfo si;
+	struct timeval tv, zero = { 0, 0 };
+	sigset_t mask;
+	uint64_t deadline = 0, now;
+	int sfd, n, i, timeout, left, r, ret = 0;
+
+	if (hub_stop_fd >= 0) {
+		sfd = hub_stop_fd;
+	} else {
+		sigemptyset(&mask);
+		sigaddset(&mask, SIGINT);
+		sigaddset(&mask, SIGTERM);
+		pthread_sigmask(SIG_BLOCK, &mask, NULL);
+		sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+		if (sfd < 0) {
+			perr("signalfd failed: %s\n", strerror(errno));
+			return -1;
+		}
+	}
+	if (timeout_ms >= 0)
+		deadline = now_ns() + (uint64_t)timeout_ms * 1000000;
+
+	for (;;) {
+		n = 0;
+		fds[n].fd = sfd;
+		fds[n++].events = POLLIN;
+		lfds = libusb_get_pollfds(ctx);
+		for (i = 0; lfds && lfds[i] && n < HUB_MAX_POLLFDS; i++) {
+			fds[n].fd = lfds[i]->fd;
+			fds[n++].events = lfds[i]->events;
+		}
+		libusb_free_pollfds(lfds);
+
+		timeout = -1;
+		if (libusb_get_next_timeout(ctx, &tv) == 1)
+			timeout = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+		if (deadline) {
+			now = now_ns();
+			if (now >= deadline)
+				break;
+			left = (deadline - now + 999999) / 1000000;
+			if (timeout < 0 || left < timeout)
+				timeout = left;
+		}
+		r = poll(fds, n, timeout);
+		if (r < 0 && errno != EINTR) {
+			perr("poll failed: %s\n", strerror(errno));
+			break;
+		}
+		if (fds[0].revents & POLLIN) {
+			/* the stop eventfd is left set, so every worker sees it */
+			if (sfd != hub_stop_fd && read(sfd, &si, sizeof(si)) == sizeof(si))
+				printf("signal %u, stopping\n", si.ssi_signo);
+			ret = 1;
+			break;
+		}
+		libusb_handle_events_timeout_completed(ctx, &zero, NULL);
+		if (idle)
+			idle(ctx);
+	}
+	if (sfd != hub_stop_fd)
+		close(sfd);
+	return ret;
+}
+
+/*
+ * Hub table: every hub under test gets an entry, and each step of the
+ * arming sequence is one batch across all of them, so several hubs cost
+ * the same round trips as one.
+ */
+#define MAX_HUBS		32
+#define MAX_HUB_PORTS		255
+#define HUB_DESC_SIZE		100
+
+/* hub descriptor, USB 2.0 11.23.2.1 and USB 3.x 10.15.2.1 */
+struct hub_desc {
+	uint8_t type;
+	int nports;
+	uint16_t characteristics;
+	unsigned int pwr_on_ms;		/* bPwrOn2PwrGood */
+	unsigned int current_ma;	/* bHubContrCurrent */
+	uint8_t removable[32];		/* DeviceRemovable: bit n set, port n is not removable */
+};
+
+struct hub_dev {
+	libusb_device_handle *handle;
+	uint8_t bus;
+	uint8_t path[7];
+	int depth;
+	uint16_t vid;
+	uint16_t pid;
+	uint16_t bcd;
+	uint8_t desc[HUB_DESC_SIZE];
+	int desc_res;
+	struct hub_desc hd;
+	bool desc_cached;
+	bool superspeed;	/* USB3 hub: SS hub descriptor and compliance mode */
+	uint64_t xfers;
+	uint64_t xfer_max_ns;
+	unsigned int timeouts;
+	int test_res;
+	int suspend_res[MAX_HUB_PORTS + 1];
+	bool armed;
+	bool gone;		/* unplugged, closed at the next idle point */
+	const char *error;
+};
+
+static __thread struct hub_dev hubs[MAX_HUBS];
+static __thread int nhubs;
+static bool hub_all = false;
+static uint8_t hub_selector = USB_TEST_PACKET;
+
+/* PORT_TEST and TEST_MODE selectors, USB 2.0 table 9-7 */
+static const char *const hub_selector_names[] = {
+	"-", "J", "K", "SE0_NAK", "Packet", "Force_Enable",
+};
+
+struct hub_id {
+	uint16_t vid;
+	uint16_t pid;
+};
+
+static struct hub_id hub_ids[MAX_HUBS];
+static int nhub_ids;
+
+/* a selector name or its number, 0 if neither */
+static uint8_t hub_selector_parse(const char *str)
+{
+	char *end;
+	unsigned long v;
+	int i;
+
+	for (i = USB_TEST_J; i <= USB_TEST_SOF; i++)
+		if (strcasecmp(str, hub_selector_names[i]) == 0)
+			return i;
+	v = strtoul(str, &end, 0);
+	if (*str && *end == '\0' && v >= USB_TEST_J && v <= USB_TEST_SOF)
+		return v;
+	return 0;
+}
+
+static const char *hub_path_str(const struct hub_dev *h, char *buf, size_t len)
+{
+	int i, n;
+
+	n = snprintf(buf, len, "%u-", h->bus);
+	for (i = 0; i < h->depth && n < (int)len; i++)
+		n += snprintf(buf + n, len - n, i ? ".%u" : "%u", h->path[i]);
+	if (h->depth == 0)
+		snprintf(buf + n, len - n, "0");
+	return buf;
+}
+
+static void hub_note_xfer(libusb_device_handle *handle, uint64_t ns, int r)
+{
+	int i;
+
+	for (i = 0; i < nhubs; i++) {
+		if (hubs[i].handle != handle)
+			continue;
+		hubs[i].xfers++;
+		if (ns > hubs[i].xfer_max_ns)
+			hubs[i].xfer_max_ns = ns;
+		if (r == LIBUSB_ERROR_TIMEOUT)
+			hubs[i].timeouts++;
+		return;
+	}
+}
+
+#define HUB_SLOW_NS		(20 * 1000000ULL)
+
+static void hub_rq_report(const char *who, const struct hub_rq_stats *stats)
+{
+	const struct hub_rq_stats *st;
+	int i;
+
+	printf("%scontrol transfer latency, submit to completion:\n", who);
+	for (i = 0; i < HUB_RQ_NUM; i++) {
+		st = &stats[i];
+		if (st->lat.count == 0 && st->errors == 0)
+			continue;
+		printf("  %-12s n %llu p50 %.3f ms p99 %.3f ms max %.3f ms timeouts %llu errors %llu\n", hub_rq_names[i],
+			(unsigned long long)st->lat.count, jitter_percentile(&st->lat, 500) / 1e6,
+			jitter_percentile(&st->lat, 990) / 1e6, st->lat.max / 1e6,
+			(unsigned long long)st->timeouts, (unsigned long long)st->errors);
+	}
+}
+
+static void hub_xfer_report(const char *who)
+{
+	char path[32];
+	int i;
+
+	hub_rq_report(who, hub_rq_stats);
+	for (i = 0; i < nhubs; i++) {
+		if (hubs[i].xfers == 0)
+			continue;
+		printf("  %-12s %04X:%04X requests %llu max %.3f ms timeouts %u%s\n", hub_path_str(&hubs[i], path, sizeof(path)),
+			hubs[i].vid, hubs[i].pid, (unsigned long long)hubs[i].xfers, hubs[i].xfer_max_ns / 1e6, hubs[i].timeouts,
+			hubs[i].xfer_max_ns > HUB_SLOW_NS || hubs[i].timeouts ? "  <- slow" : "");
+	}
+}
+
+static int hub_add(libusb_device_handle *handle)
+{
+	libusb_device *dev = libusb_get_device(handle);
+	struct libusb_device_descriptor dd;
+	struct hub_dev *h;
+	int r;
+
+	if (nhubs == MAX_HUBS) {
+		printf("At most %d hubs can be tested at once\n", MAX_HUBS);
+		return -1;
+	}
+	h = &hubs[nhubs];
+	memset(h, 0, sizeof(*h));
+	h->handle = handle;
+	h->bus = libusb_get_bus_number(dev);
+	r = libusb_get_port_numbers(dev, h->path, sizeof(h->path));
+	h->depth = r > 0 ? r : 0;
+	if (libusb_get_device_descriptor(dev, &dd) == 0) {
+		h->vid = dd.idVendor;
+		h->pid = dd.idProduct;
+		h->bcd = dd.bcdDevice;
+	}
+	h->superspeed = libusb_get_device_speed(dev) >= LIBUSB_SPEED_SUPER;
+	nhubs++;
+	return 0;
+}
+
+/*
+ * Topology map: the device list is read once per run and every device
+ * is kept with its bus and port chain, so hubs can be addressed by
+ * physical position (identical hubs share a VID:PID) and later lookups
+ * do not enumerate again.
+ */
+#define MAX_TOPO		128
+
+struct topo_node {
+	libusb_device *dev;
+	uint8_t bus;
+	uint8_t path[7];
+	int depth;
+	uint16_t vid;
+	uint16_t pid;
+	uint8_t dev_class;
+};
+
+static __thread struct topo_node topo[MAX_TOPO];
+static __thread int ntopo = -1;
+static const char *hub_paths[MAX_HUBS];
+static int nhub_paths;
+
+static int topo_scan(libusb_context *ctx)
+{
+	struct libusb_device_descriptor dd;
+	struct topo_node *t;
+	libusb_device **list;
+	ssize_t cnt, i;
+	int r;
+
+	if (ntopo >= 0)
+		return 0;
+	cnt = libusb_get_device_list(ctx, &list);
+	if (cnt < 0) {
+		perr("get device list failed: %s\n", libusb_error_name((int)cnt));
+		return -1;
+	}
+	ntopo = 0;
+	for (i = 0; i < cnt && ntopo < MAX_TOPO; i++) {
+		if (libusb_get_device_descriptor(list[i], &dd) != 0)
+			continue;
+		t = &topo[ntopo++];
+		t->dev = libusb_ref_device(list[i]);
+		t->bus = libusb_get_bus_number(list[i]);
+		r = libusb_get_port_numbers(list[i], t->path, sizeof(t->path));
+		t->depth = r > 0 ? r : 0;
+		t->vid = dd.idVendor;
+		t->pid = dd.idProduct;
+		t->dev_class = dd.bDeviceClass;
+	}
+	libusb_free_device_list(list, 1);
+	return 0;
+}
+
+static void topo_free(void)
+{
+	int i;
+
+	for (i = 0; i < ntopo; i++)
+		libusb_unref_device(topo[i].dev);
+	ntopo = -1;
+}
+
+/* "bus-port.port.port", e.g. 1-1.4 */
+static struct topo_node *topo_find_path(const char *str)
+{
+	uint8_t path[7];
+	unsigned int bus, port;
+	int depth = 0, n, i;
+	const char *p;
+
+	if (sscanf(str, "%u-%n", &bus, &n) != 1)
+		return NULL;
+	p = str + n;
+	/* root hubs are printed as bus-0 */
+	if (strcmp(p, "0") == 0)
+		p++;
+	while (*p) {
+		if (depth == (int)sizeof(path) || sscanf(p, "%u%n", &port, &n) != 1 || port == 0 || port > 255)
+			return NULL;
+		path[depth++] = port;
+		p += n;
+		if (*p == '.' && p[1])
+			p++;
+		else if (*p)
+			return NULL;
+	}
+	for (i = 0; i < ntopo; i++)
+		if (topo[i].bus == bus && topo[i].depth == depth && memcmp(topo[i].path, path, depth) == 0)
+			return &topo[i];
+	return NULL;
+}
+
+static const char *topo_path_str(const struct topo_node *t, char *buf, size_t len)
+{
+	struct hub_dev tmp;
+
+	tmp.bus = t->bus;
+	tmp.depth = t->depth;
+	memcpy(tmp.path, t->path, sizeof(tmp.path));
+	return hub_path_str(&tmp, buf, len);
+}
+
+static void topo_print(void)
+{
+	char path[32];
+	int i;
+
+	for (i = 0; i < ntopo; i++) {
+		printf("  %-12s %04X:%04X%s\n", topo_path_str(&topo[i], path, sizeof(path)), topo[i].vid, topo[i].pid,
+			topo[i].dev_class == LIBUSB_CLASS_HUB ? (topo[i].depth ? " hub" : " root hub") : "");
+	}
+}
+
+static int hub_open_node(const struct topo_node *t)
+{
+	libusb_device_handle *handle;
+	int r;
+
+	r = libusb_open(t->dev, &handle);
+	if (r < 0) {
+		printf("open hub %04X:%04X on bus %u failed: %s\n", t->vid, t->pid, t->bus, libusb_error_name(r));
+		return -1;
+	}
+	if (hub_add(handle) < 0) {
+		libusb_close(handle);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * The devices picked by -all (every external hub, root hubs excluded),
+ * -path, or vid:pid (every device with one of the ids, so identical DUTs
+ * are tested together).
+ */
+static int topo_select(libusb_context *ctx, struct topo_node **sel)
+{
+	struct topo_node *t;
+	int i, k, n = 0;
+
+	if (topo_scan(ctx) < 0)
+		return -1;
+	if (hub_all) {
+		for (i = 0; i < ntopo && n < MAX_HUBS; i++)
+			if (topo[i].dev_class == LIBUSB_CLASS_HUB && topo[i].depth > 0)
+				sel[n++] = &topo[i];
+	} else if (nhub_paths) {
+		for (i = 0; i < nhub_paths; i++) {
+			t = topo_find_path(hub_paths[i]);
+			if (t == NULL) {
+				printf("no device at %s\n", hub_paths[i]);
+				continue;
+			}
+			if (t->dev_class != LIBUSB_CLASS_HUB)
+				printf("warning: %s (%04X:%04X) is not a hub\n", hub_paths[i], t->vid, t->pid);
+			sel[n++] = t;
+		}
+	} else {
+		for (i = 0; i < ntopo && n < MAX_HUBS; i++) {
+			if (topo[i].depth == 0)
+				continue;
+			for (k = 0; k < nhub_ids; k++) {
+				if (topo[i].vid == hub_ids[k].vid && topo[i].pid == hub_ids[k].pid) {
+					sel[n++] = &topo[i];
+					break;
+				}
+			}
+		}
+	}
+	return n;
+}
+
+static int hub_open_selected(libusb_context *ctx)
+{
+	struct topo_node *sel[MAX_HUBS];
+	int i, n;
+
+	n = topo_select(ctx, sel);
+	for (i = 0; i < n; i++)
+		hub_open_node(sel[i]);
+	printf("found %d device(s)\n", nhubs);
+	return nhubs ? 0 : -1;
+}
+
+static void hub_close_all(void)
+{
+	int i;
+
+	for (i = 0; i < nhubs; i++)
+		libusb_close(hubs[i].handle);
+	nhubs = 0;
+}
+
+static void hub_summary(uint16_t portnum)
+{
+	char path[32];
+	int i;
+
+	printf("hub summary:\n");
+	for (i = 0; i < nhubs; i++) {
+		printf("  %-12s %04X:%04X ports %-3d ", hub_path_str(&hubs[i], path, sizeof(path)),
+			hubs[i].vid, hubs[i].pid, hubs[i].hd.nports);
+		if (hubs[i].armed && upstream_flag)
+			printf("upstream armed, %s\n", hub_selector_names[hub_selector]);
+		else if (hubs[i].armed && hubs[i].superspeed)
+			printf("port %u in compliance mode\n", portnum);
+		else if (hubs[i].armed)
+			printf("port %u armed, %s\n", portnum, hub_selector_names[hub_selector]);
+		else
+			printf("failed: %s\n", hubs[i].error ? hubs[i].error : "unknown");
+	}
+}
+
+static int hub_desc_parse(struct hub_desc *d, const uint8_t *raw, int len)
+{
+	int n;
+
+	if (len < 7 || raw[0] < 7 || (raw[1] != LIBUSB_DT_HUB && raw[1] != LIBUSB_DT_SUPERSPEED_HUB))
+		return -1;
+	if (raw[0] < len)
+		len = raw[0];
+	memset(d, 0, sizeof(*d));
+	d->type = raw[1];
+	d->nports = raw[2];
+	d->characteristics = raw[3] | raw[4] << 8;
+	d->pwr_on_ms = raw[5] * 2;
+	if (d->type == LIBUSB_DT_SUPERSPEED_HUB) {
+		if (len < 12)
+			return -1;
+		d->current_ma = raw[6] * 4;
+		d->removable[0] = raw[10];
+		d->removable[1] = raw[11];
+	} else {
+		n = (d->nports + 1 + 7) / 8;
+		if (len < 7 + n)
+			return -1;
+		d->current_ma = raw[6];
+		memcpy(d->removable, raw + 7, n);
+	}
+	return 0;
+}
+
+static int hub_desc_fixed_ports(const struct hub_desc *d)
+{
+	int i, n = 0;
+
+	for (i = 1; i <= d->nports; i++)
+		n += (d->removable[i / 8] >> (i % 8)) & 1;
+	return n;
+}
+
+/*
+ * Descriptor cache: the raw descriptor of every hub seen is kept in a
+ * text file, one "bus-port/vid:pid:bcdDevice hexbytes" line per hub, so
+ * later runs skip the 1 s worst case round trip. A hub with another
+ * firmware revision or at another position gets its own entry.
+ */
+#define HUB_DESC_CACHE		"hub_desc.cache"
+#define MAX_DESC_CACHE		64
+
+struct desc_cache_entry {
+	char key[48];
+	uint8_t raw[HUB_DESC_SIZE];
+	int len;
+};
+
+static const char *desc_cache_path = HUB_DESC_CACHE;
+static pthread_mutex_t desc_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct desc_cache_entry desc_cache[MAX_DESC_CACHE];
+static int ndesc_cache = -1;
+
+static const char *hub_desc_key(const struct hub_dev *h, char *buf, size_t len)
+{
+	char path[32];
+
+	snprintf(buf, len, "%s/%04x:%04x:%04x", hub_path_str(h, path, sizeof(path)), h->vid, h->pid, h->bcd);
+	return buf;
+}
+
+static void desc_cache_load(void)
+{
+	struct desc_cache_entry *e;
+	char line[512], hex[2 * HUB_DESC_SIZE + 1];
+	unsigned int byte;
+	FILE *in;
+	int i;
+
+	if (ndesc_cache >= 0)
+		return;
+	ndesc_cache = 0;
+	if (desc_cache_path == NULL || (in = fopen(desc_cache_path, "r")) == NULL)
+		return;
+	while (ndesc_cache < MAX_DESC_CACHE && fgets(line, sizeof(line), in)) {
+		e = &desc_cache[ndesc_cache];
+		if (sscanf(line, "%47s %200s", e->key, hex) != 2)
+			continue;
+		for (i = 0; i < HUB_DESC_SIZE && sscanf(hex + 2 * i, "%2x", &byte) == 1; i++)
+			e->raw[i] = byte;
+		e->len = i;
+		ndesc_cache++;
+	}
+	fclose(in);
+}
+
+static struct desc_cache_entry *desc_cache_find(const char *key)
+{
+	int i;
+
+	for (i = 0; i < ndesc_cache; i++)
+		if (strcmp(desc_cache[i].key, key) == 0)
+			return &desc_cache[i];
+	return NULL;
+}
+
+static void desc_cache_put(const char *key, const uint8_t *raw, int len)
+{
+	struct desc_cache_entry *e;
+
+	e = desc_cache_find(key);
+	if (e == NULL) {
+		/* full: the oldest entry makes room */
+		if (ndesc_cache == MAX_DESC_CACHE)
+			memmove(&desc_cache[0], &desc_cache[1], --ndesc_cache * sizeof(desc_cache[0]));
+		e = &desc_cache[ndesc_cache++];
+	}
+	snprintf(e->key, sizeof(e->key), "%s", key);
+	memcpy(e->raw, raw, len);
+	e->len = len;
+}
+
+static void desc_cache_save(void)
+{
+	char tmp[PATH_MAX];
+	FILE *out;
+	int i, j;
+
+	if (desc_cache_path == NULL)
+		return;
+	snprintf(tmp, sizeof(tmp), "%s.tmp", desc_cache_path);
+	out = fopen(tmp, "w");
+	if (out == NULL) {
+		perr("descriptor cache: open %s failed: %s\n", tmp, strerror(errno));
+		return;
+	}
+	for (i = 0; i < ndesc_cache; i++) {
+		fprintf(out, "%s ", desc_cache[i].key);
+		for (j = 0; j < desc_cache[i].len; j++)
+			fprintf(out, "%02x", desc_cache[i].raw[j]);
+		fprintf(out, "\n");
+	}
+	if (fclose(out) != 0 || rename(tmp, desc_cache_path) != 0)
+		perr("descriptor cache: write %s failed: %s\n", desc_cache_path, strerror(errno));
+}
+
+/* reads the hub descriptors of hubs[first] .. hubs[nhubs - 1] missing from the cache in one batch */
+static void hub_read_desc(libusb_context *ctx, int first)
+{
+	struct hub_batch batch = { ctx, 0, 0 };
+	struct desc_cache_entry *e;
+	struct hub_dev *h;
+	char key[48];
+	bool dirty = false;
+	int k;
+
+	pthread_mutex_lock(&desc_cache_lock);
+	desc_cache_load();
+	for (k = first; k < nhubs; k++) {
+		h = &hubs[k];
+		h->error = NULL;
+		e = desc_cache_find(hub_desc_key(h, key, sizeof(key)));
+		h->desc_cached = e && hub_desc_parse(&h->hd, e->raw, e->len) == 0 &&
+			(h->hd.type == LIBUSB_DT_SUPERSPEED_HUB) == h->superspeed;
+		if (!h->desc_cached)
+			hub_submit(&batch, h->handle, HUB_REQ_DEVICE_IN, LIBUSB_REQUEST_GET_DESCRIPTOR,
+				   (h->superspeed ? LIBUSB_DT_SUPERSPEED_HUB : LIBUSB_DT_HUB)<<8, 0,
+				   h->desc, sizeof(h->desc), HUB_DESC_TIMEOUT, &h->desc_res);
+	}
+	pthread_mutex_unlock(&desc_cache_lock);
+	hub_batch_wait(&batch);
+	for (k = first; k < nhubs; k++) {
+		h = &hubs[k];
+		if (!h->desc_cached) {
+			if (h->desc_res < 0 || hub_desc_parse(&h->hd, h->desc, h->desc_res) < 0) {
+				h->error = "read hub descriptor failed";
+				continue;
+			}
+			pthread_mutex_lock(&desc_cache_lock);
+			desc_cache_put(hub_desc_key(h, key, sizeof(key)), h->desc, h->desc_res);
+			pthread_mutex_unlock(&desc_cache_lock);
+			dirty = true;
+		}
+		printf("hub %04X:%04X%s maxchild : %d, %d fixed, power good %u ms, %u mA%s\n", h->vid, h->pid,
+			h->superspeed ? " (SS)" : "", h->hd.nports, hub_desc_fixed_ports(&h->hd),
+			h->hd.pwr_on_ms, h->hd.current_ma, h->desc_cached ? " (cached)" : "");
+	}
+	if (dirty) {
+		pthread_mutex_lock(&desc_cache_lock);
+		desc_cache_save();
+		pthread_mutex_unlock(&desc_cache_lock);
+	}
+}
+
+/* arms hubs[first] .. hubs[nhubs - 1], returns how many were armed */
+static int hub_arm(libusb_context *ctx, int first, uint16_t portnum)
+{
+	struct hub_batch batch = { ctx, 0, 0 };
+	struct hub_dev *h;
+	int i, k, armed = 0;
+
+	for (k = first; k < nhubs; k++) {
+		hubs[k].armed = false;
+		hubs[k].error = NULL;
+		hubs[k].test_res = 0;
+	}
+	/* upstream TEST_MODE is a standard request, the DUT need not be a hub */
+	if (!upstream_flag)
+		hub_read_desc(ctx, first);
+	for (k = first; k < nhubs; k++) {
+		h = &hubs[k];
+		if (h->error)
+			continue;
+		if (!upstream_flag && portnum > h->hd.nports) {
+			printf("Please type a num smaller than maxchild %d!\n", h->hd.nports);
+			h->error = "port number out of range";
+		} else if (upstream_flag && h->superspeed) {
+			h->error = "upstream test mode is USB2 only, test the USB2 companion hub";
+		} else if (h->superspeed && hub_selector != USB_TEST_PACKET) {
+			h->error = "SuperSpeed ports only have compliance mode";
+		}
+	}
+
+	if (upstream_flag) {
+		printf("Test upstream selector %s\n", hub_selector_names[hub_selector]);
+		for (k = first; k < nhubs; k++)
+			if (hubs[k].error == NULL)
+				hub_submit(&batch, hubs[k].handle,
+					   LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_STANDARD | LIBUSB_RECIPIENT_DEVICE,
+					   LIBUSB_REQUEST_SET_FEATURE, USB_DEVICE_TEST_MODE, hub_selector<<8, NULL, 0,
+					   HUB_PORT_TIMEOUT, &hubs[k].test_res);
+		hub_batch_wait(&batch);
+	} else {
+		printf("Test downstream port %d selector %s\n", portnum, hub_selector_names[hub_selector]);
+		/*
+		 * PORT_TEST requires every other port to be suspended first: one batch, then the test.
+		 * SuperSpeed ports go straight to compliance mode through PORT_LINK_STATE.
+		 */
+		for (k = first; k < nhubs; k++) {
+			h = &hubs[k];
+			if (h->error || h->superspeed)
+				continue;
+			for (i = 1; i < (h->hd.nports+1); i++)
+				if (i != portnum)
+					hub_submit(&batch, h->handle, HUB_REQ_PORT_OUT, LIBUSB_REQUEST_SET_FEATURE,
+						   USB_PORT_FEAT_SUSPEND, i, NULL, 0, HUB_PORT_TIMEOUT, &h->suspend_res[i]);
+		}
+		hub_batch_wait(&batch);
+		for (k = first; k < nhubs; k++) {
+			h = &hubs[k];
+			if (h->error)
+				continue;
+			if (h->superspeed) {
+				hub_submit(&batch, h->handle, HUB_REQ_PORT_OUT, LIBUSB_REQUEST_SET_FEATURE,
+					   USB_PORT_FEAT_LINK_STATE, USB_SS_LINK_COMPLIANCE<<8 | portnum, NULL, 0,
+					   HUB_PORT_TIMEOUT, &h->test_res);
+				continue;
+			}
+			for (i = 1; i < (h->hd.nports+1); i++)
+				if (i != portnum && h->suspend_res[i] < 0)
+					printf("hub %04X:%04X suspend port %d failed: %s\n", h->vid, h->pid, i,
+						libusb_error_name(h->suspend_res[i]));
+			hub_submit(&batch, h->handle, HUB_REQ_PORT_OUT, LIBUSB_REQUEST_SET_FEATURE,
+				   USB_PORT_FEAT_TEST, hub_selector<<8 | portnum, NULL, 0, HUB_PORT_TIMEOUT, &h->test_res);
+		}
+		hub_batch_wait(&batch);
+	}
+
+	for (k = first; k < nhubs; k++) {
+		h = &hubs[k];
+		if (h->error)
+			continue;
+		if (h->test_res < 0)
+			h->error = libusb_error_name(h->test_res);
+		else
+			h->armed = true;
+		armed += h->armed;
+	}
+	return armed;
+}
+
+/*
+ * Restore: takes hubs out of test mode without a replug. Suspended USB2
+ * ports are resumed and SuperSpeed test ports get a warm (BH) reset in
+ * one batch. A USB2 port only leaves PORT_TEST through a hub reset;
+ * those resets run in parallel, one thread per hub, and the hubs that
+ * re-enumerate are waited for together, through a hotplug callback where
+ * the platform has one and by polling the device list otherwise.
+ */
+#define HUB_REENUM_TIMEOUT_MS	5000
+#define HUB_REENUM_POLL_MS	20
+
+struct hub_reset_job {
+	struct hub_dev *h;
+	pthread_t thread;
+	bool threaded;
+	uint8_t old_addr;
+	int result;
+	uint64_t reset_ns;
+	uint64_t done_ns;
+	libusb_device *dev;	/* the hub after re-enumeration */
+};
+
+struct hub_reopen_set {
+	struct hub_reset_job *jobs;
+	int njobs;
+	int left;
+};
+
+static bool hub_restore_only = false;
+
+/* same bus and port chain, but a new address: the hub after re-enumeration */
+static bool hub_reopen_match(const struct hub_reset_job *job, libusb_device *dev)
+{
+	uint8_t path[7];
+	int depth;
+
+	if (libusb_get_bus_number(dev) != job->h->bus || libusb_get_device_address(dev) == job->old_addr)
+		return false;
+	depth = libusb_get_port_numbers(dev, path, sizeof(path));
+	return depth == job->h->depth && memcmp(path, job->h->path, depth) == 0;
+}
+
+static void hub_reopen_found(struct hub_reopen_set *set, libusb_device *dev)
+{
+	struct hub_reset_job *job;
+	int i;
+
+	for (i = 0; i < set->njobs; i++) {
+		job = &set->jobs[i];
+		if (job->result == LIBUSB_ERROR_NOT_FOUND && job->dev == NULL && hub_reopen_match(job, dev)) {
+			job->dev = libusb_ref_device(dev);
+			set->left--;
+			return;
+		}
+	}
+}
+
+static int LIBUSB_CALL hub_reopen_cb(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *user_data)
+{
+	hub_reopen_found(user_data, dev);
+	return 0;
+}
+
+static void hub_reopen_poll(libusb_context *ctx, struct hub_reopen_set *set)
+{
+	libusb_device **list;
+	ssize_t cnt, i;
+
+	cnt = libusb_get_device_list(ctx, &list);
+	if (cnt < 0)
+		return;
+	for (i = 0; i < cnt && set->left; i++)
+		hub_reopen_found(set, list[i]);
+	libusb_free_device_list(list, 1);
+}
+
+static void hub_reopen_wait(libusb_context *ctx, struct hub_reopen_set *set)
+{
+	struct timeval tv = { 0, HUB_REENUM_POLL_MS * 1000 };
+	libusb_hotplug_callback_handle cb;
+	uint64_t deadline;
+	bool hotplug;
+
+	deadline = now_ns() + (uint64_t)HUB_REENUM_TIMEOUT_MS * 1000000;
+	hotplug = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+		libusb_hotplug_register_callback(ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_ENUMERATE,
+			LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_CLASS_HUB,
+			hub_reopen_cb, set, &cb) == LIBUSB_SUCCESS;
+	while (set->left > 0 && now_ns() < deadline) {
+		if (hotplug) {
+			libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+		} else {
+			usleep(HUB_REENUM_POLL_MS * 1000);
+			hub_reopen_poll(ctx, set);
+		}
+	}
+	if (hotplug)
+		libusb_hotplug_deregister_callback(ctx, cb);
+}
+
+static void *hub_reset_thread(void *arg)
+{
+	struct hub_reset_job *job = arg;
+	uint64_t start;
+
+	start = now_ns();
+	job->result = libusb_reset_device(job->h->handle);
+	job->done_ns = now_ns();
+	job->reset_ns = job->done_ns - start;
+	return NULL;
+}
+
+/*
+ * Resets the hubs with sel[k] set and reopens those that re-enumerated;
+ * hubs that do not come back are dropped from the table. Returns the
+ * number of hubs that failed.
+ */
+static int hub_reset_hubs(libusb_context *ctx, const bool *sel, uint64_t *reset_ns, uint64_t *reopen_ns)
+{
+	struct hub_reset_job jobs[MAX_HUBS], *job;
+	struct hub_reopen_set set = { jobs, 0, 0 };
+	uint64_t start, ready = 0;
+	char path[32];
+	int i, k, r, failed = 0;
+
+	*reset_ns = 0;
+	*reopen_ns = 0;
+	for (k = 0; k < nhubs; k++) {
+		if (!sel[k])
+			continue;
+		job = &jobs[set.njobs++];
+		memset(job, 0, sizeof(*job));
+		job->h = &hubs[k];
+		job->old_addr = libusb_get_device_address(libusb_get_device(hubs[k].handle));
+		job->threaded = pthread_create(&job->thread, NULL, hub_reset_thread, job) == 0;
+		if (!job->threaded)
+			hub_reset_thread(job);
+	}
+	for (i = 0; i < set.njobs; i++) {
+		job = &jobs[i];
+		if (job->threaded)
+			pthread_join(job->thread, NULL);
+		if (job->reset_ns > *reset_ns)
+			*reset_ns = job->reset_ns;
+		if (job->result == LIBUSB_ERROR_NOT_FOUND) {
+			libusb_close(job->h->handle);
+			job->h->handle = NULL;
+			set.left++;
+		} else if (job->result < 0) {
+			printf("hub %s reset failed: %s\n", hub_path_str(job->h, path, sizeof(path)),
+				libusb_error_name(job->result));
+			failed++;
+		}
+	}
+	if (set.left) {
+		start = now_ns();
+		hub_reopen_wait(ctx, &set);
+		*reopen_ns = now_ns() - start;
+	}
+	for (i = 0; i < set.njobs; i++) {
+		job = &jobs[i];
+		if (job->dev == NULL)
+			continue;
+		r = libusb_open(job->dev, &job->h->handle);
+		if (r == 0)
+			job->h->superspeed = libusb_get_device_speed(job->dev) >= LIBUSB_SPEED_SUPER;
+		else
+			printf("hub %s reopen failed: %s\n", hub_path_str(job->h, path, sizeof(path)), libusb_error_name(r));
+		libusb_unref_device(job->dev);
+		job->done_ns = now_ns();
+	}
+
+	/* the downstream ports are powered again bPwrOn2PwrGood after the reset */
+	for (i = 0; i < set.njobs; i++) {
+		job = &jobs[i];
+		if (job->h->handle && job->done_ns + job->h->hd.pwr_on_ms * 1000000ULL > ready)
+			ready = job->done_ns + job->h->hd.pwr_on_ms * 1000000ULL;
+	}
+	start = now_ns();
+	if (ready > start)
+		usleep((ready - start) / 1000);
+
+	for (k = nhubs - 1; k >= 0; k--) {
+		if (hubs[k].handle)
+			continue;
+		printf("hub %s did not come back after reset, dropped\n", hub_path_str(&hubs[k], path, sizeof(path)));
+		hubs[k] = hubs[--nhubs];
+		failed++;
+	}
+	return failed;
+}
+
+/*
+ * all: the test state is unknown (-restore after an interrupted run), so
+ * every USB2 hub is reset and every SuperSpeed port gets a warm reset.
+ * A device whose upstream port was put in test mode only leaves it on a
+ * power cycle (USB 2.0 9.4.9), so it is left alone and reported.
+ */
+static int hub_restore(libusb_context *ctx, uint16_t portnum, bool all)
+{
+	struct hub_batch batch = { ctx, 0, 0 };
+	struct hub_dev *h;
+	bool sel[MAX_HUBS];
+	char path[32];
+	uint64_t start, reset_ns = 0, reopen_ns = 0;
+	int i, k, nreset = 0, nskip = 0, failed;
+
+	start = now_ns();
+	for (k = 0; k < nhubs; k++) {
+		h = &hubs[k];
+		if (upstream_flag && h->armed) {
+			printf("hub %s upstream port in test mode, power-cycle it to recover\n",
+				hub_path_str(h, path, sizeof(path)));
+			sel[k] = false;
+			nskip++;
+			continue;
+		}
+		sel[k] = !h->superspeed && (all || h->armed);
+		nreset += sel[k];
+		if (sel[k])
+			continue;
+		for (i = 1; i < (h->hd.nports+1); i++) {
+			if (h->superspeed && (all || (h->armed && i == portnum)))
+				hub_submit(&batch, h->handle, HUB_REQ_PORT_OUT, LIBUSB_REQUEST_SET_FEATURE,
+					   USB_PORT_FEAT_BH_RESET, i, NULL, 0, HUB_PORT_TIMEOUT, NULL);
+			else if (!h->superspeed)
+				hub_submit(&batch, h->handle, HUB_REQ_PORT_OUT, LIBUSB_REQUEST_CLEAR_FEATURE,
+					   USB_PORT_FEAT_SUSPEND, i, NULL, 0, HUB_PORT_TIMEOUT, &h->suspend_res[i]);
+		}
+	}
+	failed = hub_batch_wait(&batch);
+	if (failed != 0)
+		printf("restore of %d port(s) failed\n", failed);
+	if (nreset)
+		failed += hub_reset_hubs(ctx, sel, &reset_ns, &reopen_ns);
+	for (k = 0; k < nhubs; k++)
+		hubs[k].armed = false;
+	printf("restored %d hub(s), %d reset, in %.3f ms (reset %.3f ms, re-enumeration %.3f ms)\n", nhubs - nskip, nreset,
+		(now_ns() - start) / 1e6, reset_ns / 1e6, reopen_ns / 1e6);
+	return failed ? -1 : 0;
+}
+
+static int hub_test(libusb_context *ctx, uint16_t portnum)
+{
+	uint64_t start;
+	int armed;
+
+	start = now_ns();
+	armed = hub_arm(ctx, 0, portnum);
+	printf("armed %d of %d hub(s) in %.3f ms\n", armed, nhubs, (now_ns() - start) / 1e6);
+	hub_summary(portnum);
+	if (armed == 0)
+		return -1;
+
+	printf("Test running, press Ctrl-C to stop\n");
+	hub_event_loop(ctx, NULL, -1);
+	hub_restore(ctx, portnum, false);
+	return 0;
+}
+
+/*
+ * Hotplug arming: arrivals of the target VID:PID (or of any hub) are
+ * queued by the hotplug callback, where no I/O may be done, and armed
+ * from the event loop right after libusb returns. Departed hubs are
+ * dropped from the table.
+ */
+struct hub_arrival {
+	libusb_device *dev;
+	uint64_t ts;
+};
+
+static struct hub_arrival arrivals[MAX_HUBS];
+static int narrivals;
+static uint16_t hotplug_portnum;
+static bool hub_hotplug = false;
+
+static int LIBUSB_CALL hub_hotplug_cb(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *user_data)
+{
+	int i;
+
+	if (libusb_get_port_number(dev) == 0)
+		return 0;
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+		if (narrivals == MAX_HUBS) {
+			printf("hotplug: arrival queue full\n");
+			return 0;
+		}
+		arrivals[narrivals].dev = libusb_ref_device(dev);
+		arrivals[narrivals].ts = now_ns();
+		narrivals++;
+		return 0;
+	}
+
+	for (i = 0; i < narrivals; i++) {
+		if (arrivals[i].dev == dev) {
+			libusb_unref_device(dev);
+			arrivals[i] = arrivals[--narrivals];
+			return 0;
+		}
+	}
+	/* the table may be in the middle of a batch, so only mark the entry */
+	for (i = 0; i < nhubs; i++) {
+		if (libusb_get_device(hubs[i].handle) == dev) {
+			printf("hotplug: hub %04X:%04X left\n", hubs[i].vid, hubs[i].pid);
+			hubs[i].gone = true;
+			break;
+		}
+	}
+	return 0;
+}
+
+static void hub_hotplug_idle(libusb_context *ctx)
+{
+	libusb_device_handle *handle;
+	char path[32];
+	int i, r, first;
+	uint64_t ts[MAX_HUBS];
+
+	for (i = nhubs - 1; i >= 0; i--) {
+		if (hubs[i].gone) {
+			libusb_close(hubs[i].handle);
+			hubs[i] = hubs[--nhubs];
+		}
+	}
+	first = nhubs;
+	if (narrivals == 0)
+		return;
+	for (i = 0; i < narrivals; i++) {
+		r = libusb_open(arrivals[i].dev, &handle);
+		libusb_unref_device(arrivals[i].dev);
+		if (r < 0) {
+			printf("hotplug: open failed: %s\n", libusb_error_name(r));
+			continue;
+		}
+		if (hub_add(handle) < 0) {
+			libusb_close(handle);
+			continue;
+		}
+		ts[nhubs - 1] = arrivals[i].ts;
+	}
+	narrivals = 0;
+	if (first == nhubs)
+		return;
+
+	hub_arm(ctx, first, hotplug_portnum);
+	for (i = first; i < nhubs; i++) {
+		if (hubs[i].armed)
+			printf("hotplug: %s %04X:%04X armed %.3f ms after arrival\n", hub_path_str(&hubs[i], path, sizeof(path)),
+				hubs[i].vid, hubs[i].pid, (now_ns() - ts[i]) / 1e6);
+		else
+			printf("hotplug: %s %04X:%04X failed: %s\n", hub_path_str(&hubs[i], path, sizeof(path)),
+				hubs[i].vid, hubs[i].pid, hubs[i].error ? hubs[i].error : "unknown");
+	}
+}
+
+static int hub_hotplug_run(libusb_context *ctx, uint16_t vid, uint16_t pid, uint16_t portnum)
+{
+	libusb_hotplug_callback_handle cb;
+	int r;
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		printf("hotplug is not supported on this platform\n");
+		return -1;
+	}
+	hotplug_portnum = portnum;
+	/*
+	 * Any-hub mode only arms hubs plugged in from now on: the fixture's
+	 * own hubs upstream of the DUT are already attached, and arming one
+	 * would cut off everything behind it.
+	 */
+	r = libusb_hotplug_register_callback(ctx,
+		LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, vid ? LIBUSB_HOTPLUG_ENUMERATE : 0,
+		vid ? vid : LIBUSB_HOTPLUG_MATCH_ANY, vid ? pid : LIBUSB_HOTPLUG_MATCH_ANY,
+		vid ? LIBUSB_HOTPLUG_MATCH_ANY : LIBUSB_CLASS_HUB, hub_hotplug_cb, NULL, &cb);
+	if (r != LIBUSB_SUCCESS) {
+		printf("hotplug: register callback failed: %s\n", libusb_error_name(r));
+		return -1;
+	}
+	if (vid)
+		printf("hotplug: waiting for %04X:%04X, press Ctrl-C to stop\n", vid, pid);
+	else
+		printf("hotplug: waiting for any hub, press Ctrl-C to stop\n");
+
+	/* with a VID:PID, devices present at registration were queued by LIBUSB_HOTPLUG_ENUMERATE */
+	hub_hotplug_idle(ctx);
+	hub_event_loop(ctx, hub_hotplug_idle, -1);
+
+	libusb_hotplug_deregister_callback(ctx, cb);
+	hub_restore(ctx, portnum, false);
+	return 0;
+}
+
+/*
+ * Sweep: every downstream port is tested with every selector in turn.
+ * A port only leaves PORT_TEST through a hub reset, so each step ends
+ * with a reset of the hubs it touched (see hub_reset_hubs()).
+ */
+#define HUB_SWEEP_DWELL_MS	5000
+
+struct sweep_step {
+	uint16_t port;
+	uint8_t sel;
+	int armed;
+	uint64_t arm_ns;
+	uint64_t reset_ns;
+	uint64_t reopen_ns;
+};
+
+static bool hub_sweep = false;
+static unsigned int hub_dwell_ms = HUB_SWEEP_DWELL_MS;
+
+static int hub_sweep_run(libusb_context *ctx)
+{
+	struct sweep_step *steps, *st;
+	bool sel_reset[MAX_HUBS];
+	uint64_t start;
+	int maxports = 0, nsteps = 0, stop = 0, k;
+	uint16_t port;
+	uint8_t sel;
+
+	hub_read_desc(ctx, 0);
+	for (k = 0; k < nhubs; k++)
+		if (hubs[k].hd.nports > maxports)
+			maxports = hubs[k].hd.nports;
+	if (maxports == 0)
+		return -1;
+	steps = calloc(maxports * USB_TEST_SOF, sizeof(*steps));
+	if (steps == NULL)
+		return -1;
+
+	printf("Sweep %d port(s) x %d selectors, dwell %u ms\n", maxports, USB_TEST_SOF, hub_dwell_ms);
+	start = now_ns();
+	for (port = 1; port <= maxports && !stop && nhubs; port++) {
+		for (sel = USB_TEST_J; sel <= USB_TEST_SOF && !stop && nhubs; sel++) {
+			st = &steps[nsteps++];
+			st->port = port;
+			st->sel = sel;
+			hub_selector = sel;
+
+			st->arm_ns = now_ns();
+			st->armed = hub_arm(ctx, 0, port);
+			st->arm_ns = now_ns() - st->arm_ns;
+			hub_summary(port);
+			if (st->armed)
+				stop = hub_event_loop(ctx, NULL, hub_dwell_ms);
+
+			/* a port in PORT_TEST, and the suspended ports around it, come back through a hub reset */
+			for (k = 0; k < nhubs; k++)
+				sel_reset[k] = hubs[k].armed || (!hubs[k].superspeed && port <= hubs[k].hd.nports);
+			hub_reset_hubs(ctx, sel_reset, &st->reset_ns, &st->reopen_ns);
+			printf("step %d: port %u %s armed %d arm %.3f ms reset %.3f ms reopen %.3f ms\n", nsteps, port,
+				hub_selector_names[sel], st->armed, st->arm_ns / 1e6, st->reset_ns / 1e6, st->reopen_ns / 1e6);
+		}
+	}
+
+	printf("sweep summary: %d step(s) in %.3f s%s\n", nsteps, (now_ns() - start) / 1e9, stop ? ", stopped" : "");
+	printf("  port selector     armed   arm ms   reset ms  reopen ms\n");
+	for (k = 0; k < nsteps; k++) {
+		st = &steps[k];
+		printf("  %-4u %-12s %5d %8.3f %10.3f %10.3f\n", st->port, hub_selector_names[st->sel], st->armed,
+			st->arm_ns / 1e6, st->reset_ns / 1e6, st->reopen_ns / 1e6);
+	}
+	free(steps);
+	return 0;
+}
+
+static int hub_run(libusb_context *ctx, uint16_t portnum)
+{
+	if (hub_restore_only) {
+		hub_read_desc(ctx, 0);
+		return hub_restore(ctx, portnum, true);
+	}
+	if (hub_sweep)
+		return hub_sweep_run(ctx);
+	return hub_test(ctx, portnum);
+}
+
+/*
+ * Workers: the selected devices are dealt out by bus-port path to
+ * -workers threads. Each owns a libusb_context, its own event loop and
+ * its own (thread local) hub table, topology map and request stats, so
+ * no event handling is shared between them; the stats are merged at
+ * the end.
+ */
+#define MAX_HUB_WORKERS		MAX_HUBS
+
+struct hub_worker {
+	int id;
+	pthread_t thread;
+	char paths[MAX_HUBS][32];
+	int npaths;
+	uint16_t portnum;
+	int nhubs;
+	int ret;
+	struct hub_rq_stats stats[HUB_RQ_NUM];
+};
+
+static int hub_nworkers = 1;
+static int hub_workers_done;
+
+static void *hub_worker_run(void *arg)
+{
+	struct hub_worker *w = arg;
+	libusb_context *ctx;
+	struct topo_node *t;
+	char who[32];
+	int i;
+
+	w->ret = libusb_init(&ctx);
+	if (w->ret < 0) {
+		printf("worker %d: libusb init failed: %s\n", w->id, libusb_error_name(w->ret));
+		goto done;
+	}
+	if (topo_scan(ctx) == 0) {
+		for (i = 0; i < w->npaths; i++) {
+			t = topo_find_path(w->paths[i]);
+			if (t)
+				hub_open_node(t);
+			else
+				printf("worker %d: %s is gone\n", w->id, w->paths[i]);
+		}
+	}
+	w->nhubs = nhubs;
+	w->ret = nhubs ? hub_run(ctx, w->portnum) : -1;
+
+	snprintf(who, sizeof(who), "worker %d: ", w->id);
+	hub_xfer_report(who);
+	memcpy(w->stats, hub_rq_stats, sizeof(w->stats));
+	hub_close_all();
+	topo_free();
+	libusb_exit(ctx);
+done:
+	__atomic_add_fetch(&hub_workers_done, 1, __ATOMIC_SEQ_CST);
+	return NULL;
+}
+
+static int hub_workers_run(uint16_t portnum)
+{
+	struct topo_node *sel[MAX_HUBS];
+	struct hub_worker *workers, *w;
+	struct hub_rq_stats *total;
+	struct signalfd_siginfo si;
+	struct pollfd pfd;
+	uint64_t one = 1;
+	sigset_t mask;
+	int i, k, n, nw, sfd, ret = 0;
+
+	n = topo_select(NULL, sel);
+	if (n <= 0) {
+		perr("  Failed.\n");
+		return -1;
+	}
+	nw = hub_nworkers < n ? hub_nworkers : n;
+	workers = calloc(nw, sizeof(*workers));
+	total = calloc(HUB_RQ_NUM, sizeof(*total));
+	if (workers == NULL || total == NULL) {
+		free(workers);
+		free(total);
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		w = &workers[i % nw];
+		topo_path_str(sel[i], w->paths[w->npaths++], sizeof(w->paths[0]));
+	}
+	printf("%d device(s) on %d worker(s)\n", n, nw);
+
+	/* blocked before the workers start, so only this thread takes the signals */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+	sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+	hub_stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (sfd < 0 || hub_stop_fd < 0) {
+		perr("signalfd/eventfd failed: %s\n", strerror(errno));
+		ret = -1;
+		goto out;
+	}
+
+	for (i = 0; i < nw; i++) {
+		w = &workers[i];
+		w->id = i;
+		w->portnum = portnum;
+		if (pthread_create(&w->thread, NULL, hub_worker_run, w) != 0) {
+			perr("worker %d: thread create failed\n", i);
+			nw = i;
+			if (write(hub_stop_fd, &one, sizeof(one)) < 0)
+				perr("stop workers failed: %s\n", strerror(errno));
+			break;
+		}
+	}
+	pfd.fd = sfd;
+	pfd.events = POLLIN;
+	while (__atomic_load_n(&hub_workers_done, __ATOMIC_SEQ_CST) < nw) {
+		if (poll(&pfd, 1, 100) > 0 && read(sfd, &si, sizeof(si)) == sizeof(si)) {
+			printf("signal %u, stopping workers\n", si.ssi_signo);
+			if (write(hub_stop_fd, &one, sizeof(one)) < 0)
+				perr("stop workers failed: %s\n", strerror(errno));
+		}
+	}
+
+	for (i = 0; i < nw; i++) {
+		w = &workers[i];
+		pthread_join(w->thread, NULL);
+		for (k = 0; k < HUB_RQ_NUM; k++) {
+			jitter_merge(&total[k].lat, &w->stats[k].lat);
+			total[k].timeouts += w->stats[k].timeouts;
+			total[k].errors += w->stats[k].errors;
+		}
+		if (w->ret < 0)
+			ret = -1;
+	}
+	printf("workers:\n");
+	for (i = 0; i < nw; i++) {
+		w = &workers[i];
+		printf("  worker %d: %d of %d device(s) opened, %s\n", i, w->nhubs, w->npaths, w->ret < 0 ? "failed" : "ok");
+	}
+	hub_rq_report("all workers: ", total);
+
+out:
+	if (sfd >= 0)
+		close(sfd);
+	if (hub_stop_fd >= 0)
+		close(hub_stop_fd);
+	hub_stop_fd = -1;
+	free(workers);
+	free(total);
+	topo_free();
+	return ret;
+}
+
+static int test_device(uint16_t vid, uint16_t pid, uint16_t portnum)
+{
+	int i, ret;
+
+	if (hub_hotplug) {
+		ret = hub_hotplug_run(NULL, vid, pid, portnum);
+		hub_xfer_report("");
+		hub_close_all();
+		return ret;
+	}
+
+	if (hub_all) {
+		printf("Opening all hubs...\n");
+	} else if (nhub_paths) {
+		printf("Opening hubs by path...\n");
+	} else {
+		printf("Opening device(s)");
+		for (i = 0; i < nhub_ids; i++)
+			printf(" %04X:%04X", hub_ids[i].vid, hub_ids[i].pid);
+		printf("...\n");
+	}
+	if (hub_nworkers > 1)
+		return hub_workers_run(portnum);
+	if (hub_open_selected(NULL) < 0) {
+		perr("  Failed.\n");
+		topo_free();
+		return -1;
+	}
+
+	ret = hub_run(NULL, portnum);
+
+	hub_xfer_report("");
+	printf("Closing device...\n");
+	hub_close_all();
+	topo_free();
+
+	return ret;
+}
+
+/*
+ * Bulk and isochronous benchmark: qdepth transfers per direction stay in
+ * flight and are resubmitted from their own callback, so the endpoint
+ * never idles while the host turns a transfer around. Every transfer is
+ * timed from submit to completion. Against dummy_hcd + g_zero the
+ * source/sink interface gives a bulk IN and OUT pair in altsetting 0
+ * (modprobe dummy_hcd; modprobe g_zero; ... -bulk 0525:a4a0). dummy_hcd
+ * has no isochronous endpoints, so -iso needs g_zero on a UDC that
+ * supports them, where altsetting 1 adds the isochronous pair.
+ */
+#define BENCH_QDEPTH		8
+#define BENCH_MAX_QDEPTH	64
+#define BENCH_XFER_SIZE		16384
+#define BENCH_SECS		10
+#define BENCH_MAX_SECS		86400	/* keeps the event loop's ms timeout in an int */
+#define BENCH_TIMEOUT		1000
+#define BENCH_ISO_PACKETS	32
+#define BENCH_MAX_ISO_PACKETS	1024
+#define BENCH_IN		1
+#define BENCH_OUT		2
+
+struct bench_ep {
+	uint8_t addr;
+	uint8_t interval;	/* bInterval */
+};
+
+struct bench_dir;
+
+struct bench_slot {
+	struct bench_dir *dir;
+	struct libusb_transfer *xfer;
+	unsigned char *buf;
+	uint64_t submit_ns;
+	bool active;
+};
+
+struct bench_dir {
+	const char *name;
+	uint8_t ep;
+	libusb_device_handle *handle;
+	unsigned char *pool;
+	size_t pool_len;
+	bool devmem;
+	int inflight;
+	uint64_t bytes;
+	uint64_t xfers;
+	uint64_t short_xfers;
+	uint64_t errors;
+	uint64_t last_bytes;
+	struct link_jitter lat;
+	/* isochronous only */
+	unsigned int pkt_size;
+	unsigned int interval_us;	/* one packet per service interval */
+	uint64_t packets;
+	uint64_t pkt_errors;
+	uint64_t pkt_empty;		/* IN packets that came back without data */
+	uint64_t gaps;			/* completions 1.5 transfer periods or more apart */
+	struct link_jitter period;	/* time between completions */
+	struct bench_slot slots[BENCH_MAX_QDEPTH];
+};
+
+static bool bench_mode = false;
+static bool bench_iso = false;
+static unsigned int bench_packets = BENCH_ISO_PACKETS;
+static unsigned int bench_dirs = BENCH_IN | BENCH_OUT;
+static unsigned int bench_qdepth = BENCH_QDEPTH;
+static unsigned int bench_size = BENCH_XFER_SIZE;
+static unsigned int bench_secs = BENCH_SECS;
+static bool bench_stop;
+static struct bench_dir bench[2];
+static uint64_t bench_last_ns;
+
+/* only completed and timed out transfers go back in the queue, any other error retires the slot */
+static void bench_resubmit(struct bench_slot *slot, uint64_t now)
+{
+	struct libusb_transfer *xfer = slot->xfer;
+	struct bench_dir *d = slot->dir;
+
+	if (!bench_stop && (xfer->status == LIBUSB_TRANSFER_COMPLETED || xfer->status == LIBUSB_TRANSFER_TIMED_OUT)) {
+		slot->submit_ns = now;
+		if (libusb_submit_transfer(xfer) == 0) {
+			slot->active = true;
+			return;
+		}
+		d->errors++;
+	}
+	d->inflight--;
+}
+
+static void LIBUSB_CALL bench_cb(struct libusb_transfer *xfer)
+{
+	struct bench_slot *slot = xfer->user_data;
+	struct bench_dir *d = slot->dir;
+	uint64_t now = now_ns();
+
+	slot->active = false;
+	if (xfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		jitter_hist_add(&d->lat, now - slot->submit_ns);
+		d->bytes += xfer->actual_length;
+		d->xfers++;
+		d->short_xfers += xfer->actual_length < xfer->length;
+	} else if (xfer->status != LIBUSB_TRANSFER_CANCELLED) {
+		d->bytes += xfer->actual_length;
+		d->errors++;
+		if (xfer->status != LIBUSB_TRANSFER_TIMED_OUT)
+			printf("bulk %s: transfer failed, status %d\n", d->name, xfer->status);
 	}
+	bench_resubmit(slot, now);
+}
 
-	ret = ioctl(fd, USB_SET_CLK_CMD, &data);
-	if (ret < 0) {
-		printf("ioctl fail\n");
-		return ret;
+static void LIBUSB_CALL bench_iso_cb(struct libusb_transfer *xfer)
+{
+	struct bench_slot *slot = xfer->user_data;
+	struct bench_dir *d = slot->dir;
+	struct libusb_iso_packet_descriptor *pkt;
+	uint64_t now = now_ns();
+	int i;
+
+	slot->active = false;
+	if (xfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		for (i = 0; i < xfer->num_iso_packets; i++) {
+			pkt = &xfer->iso_packet_desc[i];
+			d->bytes += pkt->actual_length;
+			if (pkt->status != LIBUSB_TRANSFER_COMPLETED)
+				d->pkt_errors++;
+			else if (pkt->actual_length == 0 && (d->ep & LIBUSB_ENDPOINT_IN))
+				d->pkt_empty++;
+		}
+		d->packets += xfer->num_iso_packets;
+		d->xfers++;
+		if (d->period.last_ts && (now - d->period.last_ts) * 2 >= (uint64_t)d->interval_us * bench_packets * 3000)
+			d->gaps++;
+		jitter_add(&d->period, now, 1);
+	} else if (xfer->status != LIBUSB_TRANSFER_CANCELLED) {
+		d->errors++;
+		if (xfer->status != LIBUSB_TRANSFER_TIMED_OUT)
+			printf("iso %s: transfer failed, status %d\n", d->name, xfer->status);
 	}
+	bench_resubmit(slot, now);
+}
 
-	close(fd);
-}*/
+/*
+ * Transfer buffers come from one region per direction, carved into the
+ * slots once at setup, so the steady state allocates and copies nothing.
+ * libusb_dev_mem_alloc() maps DMA memory of the host controller (usbfs
+ * zerocopy) that the transfers use in place; where it is not available
+ * a page aligned pool is used instead.
+ */
+static int bench_pool_alloc(struct bench_dir *d, size_t len)
+{
+	void *mem;
 
-void usb_check_link_state (void *usbctrlcr_base) {
-	unsigned int gctl = readl(usbctrlcr_base + 0xC110);
-	unsigned int gctl_opmode = (gctl>>12) & 0x00000003;
-	unsigned int portsc_u2 = readl(usbctrlcr_base + 0x420);
-	unsigned int portsc_u3 = readl(usbctrlcr_base + 0x430);
-	unsigned int portsc_u2_spd = (portsc_u2>>10) & 0x0000000f;
-	unsigned int portsc_u3_spd = (portsc_u3>>10) & 0x0000000f;
-	unsigned int portsc_u3lt = (portsc_u3>>5) & 0x0000000f;
-	unsigned int ltssm = readl(usbctrlcr_base + 0xC164);
-	unsigned int ltssm_linkstate = (ltssm>>22) & 0x0000000F;
-	unsigned int ltssm_substate = (ltssm>>18) & 0x0000000F;
-	unsigned int dsts = readl(usbctrlcr_base + 0xC70C);
-	unsigned int dsts_speed = dsts & 0x00000007;
-	unsigned int dsts_linkstate = (dsts>>18) & 0x0000000f;
-	gctl_opmode = (gctl>>12) & 0x00000003;
-
-	if (gctl_opmode==0x2) { // Device mode
-	    printf("DSTS: %08X, DSTS_SPEED: %X, DSTS_LINK: %X.\n",dsts,dsts_speed,dsts_linkstate);
-	    printf("LTSSM: %08X, LTSSM_LINK: %08X, LTSSM_SUB: %0X.\n",ltssm,ltssm_linkstate,ltssm_substate);
-	} else {
-	    printf("PORTSC_U2: %08X, PORTSC_U3: %08X, PORTSC_U3_Link: %0X, PORTSC_U2_SPD %0X, PORTSC_U3_SPD %X.\n",portsc_u2,portsc_u3,portsc_u3lt, portsc_u2_spd, portsc_u3_spd);
-	    printf("LTSSM: %08X, LTSSM_LINK: %08X, LTSSM_SUB: %0X.\n",ltssm,ltssm_linkstate,ltssm_substate);
+	d->pool_len = len;
+	d->pool = libusb_dev_mem_alloc(d->handle, len);
+	if (d->pool) {
+		d->devmem = true;
+		memset(d->pool, 0, len);
+		return 0;
 	}
+	if (posix_memalign(&mem, sysconf(_SC_PAGESIZE), len) != 0)
+		return -1;
+	memset(mem, 0, len);	/* g_zero's sink expects zeros */
+	d->pool = mem;
+	return 0;
 }
 
-static int usb_init(int phy_num, void *base, int usb_mode, int usb_speed, int regs1, int regs2, int regs3)
+static void bench_pool_free(struct bench_dir *d)
 {
-	void *phybase = base+0x20000;
-	unsigned int data;
-	int i;
+	if (d->pool == NULL)
+		return;
+	if (d->devmem)
+		libusb_dev_mem_free(d->handle, d->pool, d->pool_len);
+	else
+		free(d->pool);
+	d->pool = NULL;
+}
 
-	/* use internal phy clock and reset usb phy, reset high effective */
-	data = readl(phybase + USB_PHY_NCR_CTRL0);
-	data &= ~(1<<18);
-	data |= (1<<0);
-	writel(data, phybase + USB_PHY_NCR_CTRL0);
+static int bench_dir_init(struct bench_dir *d, libusb_device_handle *handle, const char *name, const struct bench_ep *ep)
+{
+	libusb_device *dev = libusb_get_device(handle);
+	struct bench_slot *slot;
+	size_t page = sysconf(_SC_PAGESIZE), stride, len = bench_size;
+	unsigned int i, ival, timeout = BENCH_TIMEOUT;
+	int r;
 
-	if (phy_num == 1) {
-//		enable_clk(1, 0, 0);
-//		enable_clk(1, 1, 1);
-		printf("\033[31musb phy 1 internal clk\033[00m\n");
-		writel(0x41000005, phybase + USB_PHY_NCR_CTRL0);
-		writel(0x69254000, phybase + USB_PHY_NCR_CTRL1);
-		writel(0x0E2C7878, phybase + USB_PHY_NCR_CTRL2);
-		writel(0x3E700800, phybase + USB_PHY_NCR_CTRL3);
-		writel(PHY_NCR_REG_MASK | (regs1<<6 | regs2<<11 | regs3<<13), phybase + USB_PHY_NCR_CTRL4);
-		writel(0x00000000, phybase + USB_PHY_NCR_CTRL5);
-		writel(0x00000001, phybase + USB_PHY_NCR_CTRL6);
-		writel(0x00000000, phybase + USB_PHY_NCR_CTRL7);
-	} else if (phy_num == 2) {
-//		enable_clk(2, 0, 0);
-//		enable_clk(2, 1, 1);
-		printf("\033[31musb phy 2 internal clk\033[00m\n");
-		writel(0x41000005, phybase + USB_PHY_NCR_CTRL0);
-		writel(0x69254000, phybase + USB_PHY_NCR_CTRL1);
-		writel(0x0E2C7878, phybase + USB_PHY_NCR_CTRL2);
-		writel(0x3E700800, phybase + USB_PHY_NCR_CTRL3);
-		writel(PHY_NCR_REG_MASK | (regs1<<6 | regs2<<11 | regs3<<13), phybase + USB_PHY_NCR_CTRL4);
-		writel(0x00000000, phybase + USB_PHY_NCR_CTRL5);
-		writel(0x00000001, phybase + USB_PHY_NCR_CTRL6);
-		writel(0x00000000, phybase + USB_PHY_NCR_CTRL7);
+	memset(d, 0, sizeof(*d));
+	d->name = name;
+	d->ep = ep->addr;
+	d->handle = handle;
+	if (bench_iso) {
+		r = libusb_get_max_iso_packet_size(dev, ep->addr);
+		if (r <= 0)
+			return -1;
+		d->pkt_size = r;
+		/* bInterval is 2^(n-1) frames at full speed, 2^(n-1) microframes above */
+		ival = ep->interval < 1 ? 1 : ep->interval > 16 ? 16 : ep->interval;
+		d->interval_us = (libusb_get_device_speed(dev) >= LIBUSB_SPEED_HIGH ? 125 : 1000) << (ival - 1);
+		len = d->pkt_size * bench_packets;
+		/* the last transfer queued completes only after the whole ring has been scheduled */
+		timeout += (uint64_t)bench_qdepth * bench_packets * d->interval_us / 1000;
+	}
+	stride = (len + page - 1) / page * page;
+	if (bench_pool_alloc(d, stride * bench_qdepth) < 0)
+		return -1;
+	for (i = 0; i < bench_qdepth; i++) {
+		slot = &d->slots[i];
+		slot->dir = d;
+		slot->buf = d->pool + i * stride;
+		slot->xfer = libusb_alloc_transfer(bench_iso ? bench_packets : 0);
+		if (slot->xfer == NULL)
+			return -1;
+		if (bench_iso) {
+			libusb_fill_iso_transfer(slot->xfer, handle, d->ep, slot->buf, len, bench_packets, bench_iso_cb, slot,
+						 timeout);
+			libusb_set_iso_packet_lengths(slot->xfer, d->pkt_size);
+		} else {
+			libusb_fill_bulk_transfer(slot->xfer, handle, d->ep, slot->buf, len, bench_cb, slot, BENCH_TIMEOUT);
+		}
 	}
+	return 0;
+}
 
-	if (1) {
-		printf("\033[31musb init ctrl ncr\033[00m\n");
-		writel(0x00000003, base + USB_CTRL_NCR_INTE);
-		writel(0x00210080, base + USB_CTRL_NCR_CTRL0);
-		writel(0x00000000, base + USB_CTRL_NCR_CTRL1);
-		writel(0x00000000, base + USB_CTRL_NCR_CTRL2);
-		writel(0x00000000, base + USB_CTRL_NCR_CTRL3);
-		writel(0x00000000, base + USB_CTRL_NCR_CTRL4);
-		writel(0x00000000, base + USB_CTRL_NCR_CTRL5);
-		writel(0x00000000, base + USB_CTRL_NCR_CTRL6);
-		writel(0x00000000, base + USB_CTRL_NCR_CTRL7);
-		
-		// GUSB3PIPECTL
-		writel(0x010C0002, base + 0xC2C0);
+static void bench_dir_start(struct bench_dir *d)
+{
+	struct bench_slot *slot;
+	unsigned int i;
+	int r;
+
+	for (i = 0; i < bench_qdepth; i++) {
+		slot = &d->slots[i];
+		slot->submit_ns = now_ns();
+		r = libusb_submit_transfer(slot->xfer);
+		if (r < 0) {
+			printf("bulk %s: submit failed: %s\n", d->name, libusb_error_name(r));
+			d->errors++;
+			continue;
+		}
+		slot->active = true;
+		d->inflight++;
 	}
-	usleep(30);
+}
 
-	// phy reset
-	data = readl(phybase + USB_PHY_NCR_CTRL0);
-	data &= ~(1<<0);
-	writel(data, phybase + USB_PHY_NCR_CTRL0);
+static void bench_dir_cancel(struct bench_dir *d)
+{
+	unsigned int i;
 
-	if (usb_mode == 1) { //Device
-		printf("\033[31musb set Device mode\033[00m\n");
-		// set Device mode
-		data = readl(base + 0xc110);
-		data &= ~(0x3<<12);
-		data |= (0x2<<12);
-		writel(data, base + 0xC110);
+	for (i = 0; i < bench_qdepth; i++)
+		if (d->slots[i].active)
+			libusb_cancel_transfer(d->slots[i].xfer);
+}
 
-		// set speed
-		data = readl(base + 0xc700);
-		data &= ~(0x7);
-		if (usb_speed == 1) {
-			data |= 1; //full
-		} else if (usb_speed == 2) {
-			data |= 0; // high
-		} else if (usb_speed == 3) {
-			data |= 4; // super
-		}
-		writel(data, base + 0xC700);
+static void bench_dir_free(struct bench_dir *d)
+{
+	unsigned int i;
 
-		// set bit 30
-		data = readl(base + 0xc704);
-		data |= (0x1<<30);
-		writel(data, base + 0xC704);
-		usleep(5);
-		i = 1000;
-		while (i--)
-			if ((readl(base + 0xc704) & (1<<30)) == 0)
-				break;
-		if (i==0)
-			printf("read 0x24 timeout\n");
+	for (i = 0; i < bench_qdepth; i++)
+		libusb_free_transfer(d->slots[i].xfer);
+	bench_pool_free(d);
+}
 
-		usleep(50);
-	} else if (usb_mode == 2) { // Host
-		printf("\033[31musb set Host mode\033[00m\n");
-		// set host mode
-		data = readl(base + 0xc110);
-		data &= ~(0x3<<12);
-		data |= (0x1<<12);
-		writel(data, base + 0xC110);
-		i = 1000;
-		while (i--)
-			if ((readl(base + 0x24) & (1<<11)) == 0)
-				break;
-		if (i==0)
-			printf("read 0x24 timeout\n");
+/* the first interface altsetting of the active configuration with endpoints of the given type, in and out */
+static int bench_find_eps(libusb_device_handle *handle, uint8_t type, int *intf, int *altsetting,
+			  struct bench_ep *in, struct bench_ep *out)
+{
+	struct libusb_config_descriptor *cfg;
+	const struct libusb_interface_descriptor *alt;
+	const struct libusb_endpoint_descriptor *ep;
+	struct bench_ep *e;
+	int i, a, k, r;
 
-		data = readl(base + 0xc110);
-		data |= (0x1<<11);
-		writel(data, base + 0xC110);
-		i = 1000;
-		while (i--)
-			if ((readl(base + 0xc110) & (1<<11)) == 0)
-				break;
-		if (i==0)
-			printf("read 0xc110 timeout\n");
+	r = libusb_get_active_config_descriptor(libusb_get_device(handle), &cfg);
+	if (r < 0)
+		return r;
+	memset(in, 0, sizeof(*in));
+	memset(out, 0, sizeof(*out));
+	for (i = 0; i < cfg->bNumInterfaces && !in->addr && !out->addr; i++) {
+		for (a = 0; a < cfg->interface[i].num_altsetting && !in->addr && !out->addr; a++) {
+			alt = &cfg->interface[i].altsetting[a];
+			for (k = 0; k < alt->bNumEndpoints; k++) {
+				ep = &alt->endpoint[k];
+				if ((ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) != type)
+					continue;
+				e = (ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN ? in : out;
+				if (!e->addr) {
+					e->addr = ep->bEndpointAddress;
+					e->interval = ep->bInterval;
+				}
+			}
+			*intf = alt->bInterfaceNumber;
+			*altsetting = alt->bAlternateSetting;
+		}
+	}
+	libusb_free_config_descriptor(cfg);
+	return in->addr || out->addr ? 0 : LIBUSB_ERROR_NOT_FOUND;
+}
 
-		usleep(500);
-	
-		data = readl(base + 0xc110);
-		data &= ~(0x1<<11);
-		writel(data, base + 0xC110);
-	
-		writel(0x2a0, base + 0x420);
-		writel(0x2a0, base + 0x430);
+/* one progress line a second from the event loop */
+static void bench_progress(libusb_context *ctx)
+{
+	uint64_t now = now_ns();
+	double dt;
+	int i;
+
+	if (now - bench_last_ns < 1000000000ULL)
+		return;
+	dt = (now - bench_last_ns) / 1e9;
+	printf("  ");
+	for (i = 0; i < 2; i++) {
+		if (bench[i].ep == 0)
+			continue;
+		printf(" %s %.1f MB/s", bench[i].name, (bench[i].bytes - bench[i].last_bytes) / dt / 1e6);
+		bench[i].last_bytes = bench[i].bytes;
 	}
+	printf("\n");
+	bench_last_ns = now;
+}
 
-	printf("init ok\n");
-	return 0;
+static void bench_report(const struct bench_dir *d, double secs)
+{
+	printf("bulk %-3s ep 0x%02x: %llu transfers (%llu short), %.1f MB in %.2f s, %.2f MB/s, "
+		"latency p50 %.3f ms p90 %.3f ms p99 %.3f ms max %.3f ms, errors %llu\n",
+		d->name, d->ep, (unsigned long long)d->xfers, (unsigned long long)d->short_xfers, d->bytes / 1e6, secs,
+		secs > 0 ? d->bytes / secs / 1e6 : 0.0,
+		jitter_percentile(&d->lat, 500) / 1e6, jitter_percentile(&d->lat, 900) / 1e6,
+		jitter_percentile(&d->lat, 990) / 1e6, d->lat.max / 1e6, (unsigned long long)d->errors);
 }
 
-static int test_device(uint16_t vid, uint16_t pid, uint16_t portnum)
+static void bench_iso_report(const struct bench_dir *d, double secs)
 {
-	libusb_device_handle *handle;
-	int i, r;
-	uint8_t hub_desc[100];
-	int maxchild = 0;
+	double want = d->interval_us ? d->pkt_size * 1e6 / d->interval_us : 0;
+	double period = (double)d->interval_us * bench_packets;
+	double got = secs > 0 ? d->bytes / secs : 0;
+	double dev = d->period.max > period * 1000 ? d->period.max / 1000.0 - period : 0;
 
+	printf("iso %-3s ep 0x%02x: %u B every %u us, %llu transfers, %llu packets, %.1f MB in %.2f s, "
+		"%.2f MB/s (%.1f%% of %.2f MB/s)\n",
+		d->name, d->ep, d->pkt_size, d->interval_us, (unsigned long long)d->xfers, (unsigned long long)d->packets,
+		d->bytes / 1e6, secs, got / 1e6, want > 0 ? got * 100 / want : 0.0, want / 1e6);
+	printf("    packet errors %llu, empty %llu, transfer errors %llu, gaps %llu\n",
+		(unsigned long long)d->pkt_errors, (unsigned long long)d->pkt_empty,
+		(unsigned long long)d->errors, (unsigned long long)d->gaps);
+	printf("    completion interval: expected %.0f us, p1 %.1f us p50 %.1f us p99 %.1f us max %.1f us (%.1f microframes late)\n",
+		period, jitter_percentile(&d->period, 10) / 1000.0, jitter_percentile(&d->period, 500) / 1000.0,
+		jitter_percentile(&d->period, 990) / 1000.0, d->period.max / 1000.0, dev / 125);
+}
 
-	printf("Opening device %04X:%04X...\n", vid, pid);
-	handle = libusb_open_device_with_vid_pid(NULL, vid, pid);
+static int bench_run(void)
+{
+	libusb_device_handle *handle = NULL;
+	struct topo_node *sel[MAX_HUBS];
+	struct bench_ep ep_in, ep_out;
+	const char *kind = bench_iso ? "iso" : "bulk";
+	uint64_t start, stop;
+	int intf = 0, alt = 0, i, r;
 
+	r = libusb_init(NULL);
+	if (r < 0)
+		return r;
+	if (topo_select(NULL, sel) > 0 && libusb_open(sel[0]->dev, &handle) < 0)
+		handle = NULL;
 	if (handle == NULL) {
-		perr("  Failed.\n");
-		return -1;
+		perr("open benchmark device failed\n");
+		r = -1;
+		goto out;
 	}
-
-	if (hub_test_mode) {
-		r = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_DEVICE,
-			LIBUSB_REQUEST_GET_DESCRIPTOR, LIBUSB_DT_HUB<<8, 0, hub_desc, sizeof(hub_desc), 1000);
-		if (r<0) {
-			printf("read failed\n");
-			return -1;
-		} else {
-			maxchild = hub_desc[2];
-			printf("hub maxchild : %d\n", maxchild);
+	r = bench_find_eps(handle, bench_iso ? LIBUSB_TRANSFER_TYPE_ISOCHRONOUS : LIBUSB_TRANSFER_TYPE_BULK,
+			   &intf, &alt, &ep_in, &ep_out);
+	if (r < 0) {
+		perr("no %s endpoint found: %s\n", kind, libusb_error_name(r));
+		goto out;
+	}
+	libusb_set_auto_detach_kernel_driver(handle, 1);
+	r = libusb_claim_interface(handle, intf);
+	if (r < 0) {
+		perr("claim interface %d failed: %s\n", intf, libusb_error_name(r));
+		goto out;
+	}
+	if (alt) {
+		r = libusb_set_interface_alt_setting(handle, intf, alt);
+		if (r < 0) {
+			perr("set interface %d altsetting %d failed: %s\n", intf, alt, libusb_error_name(r));
+			goto release;
 		}
+	}
 
-		if (upstream_flag) {
-			printf("Test upstream\n");
-			libusb_control_transfer(handle, 0x00,
-				0x03, 0x0002, 0x0400, 0, 0, 100);
-		} else if (portnum > maxchild) {
-			printf("Please type a num smaller than maxchild %d!\n", maxchild);
-			return -1;
-		} else {
-			printf("Test downstream port %d\n", portnum);
-			for (i = 1; i < (maxchild+1); i++) {
-				if (i == portnum)
-					continue;
-				else
-					libusb_control_transfer(handle, 0x23,
-							0x03, 0x0002, 0x00<<8 | i, 0, 0, 100);
-			}
-			libusb_control_transfer(handle, 0x23,
-					0x03, 0x0015, 0x04<<8 | portnum, 0, 0, 100);
-		}
+	memset(bench, 0, sizeof(bench));
+	if ((bench_dirs & BENCH_IN) && ep_in.addr && bench_dir_init(&bench[0], handle, "in", &ep_in) < 0)
+		r = -1;
+	if ((bench_dirs & BENCH_OUT) && ep_out.addr && bench_dir_init(&bench[1], handle, "out", &ep_out) < 0)
+		r = -1;
+	if (r < 0 || (bench[0].ep == 0 && bench[1].ep == 0)) {
+		perr("benchmark setup failed\n");
+		r = -1;
+		goto release;
 	}
+	if (bench_iso)
+		printf("iso benchmark: interface %d altsetting %d, ring of %u transfers of %u packets, %u s, %s buffers\n",
+			intf, alt, bench_qdepth, bench_packets, bench_secs,
+			bench[0].devmem || bench[1].devmem ? "zero copy device memory" : "page aligned");
+	else
+		printf("bulk benchmark: interface %d, queue depth %u, %u byte transfers, %u s, %s buffers\n",
+			intf, bench_qdepth, bench_size, bench_secs,
+			bench[0].devmem || bench[1].devmem ? "zero copy device memory" : "page aligned");
 
-	printf("Closing device...\n");
-	libusb_close(handle);
+	bench_stop = false;
+	start = bench_last_ns = now_ns();
+	for (i = 0; i < 2; i++)
+		if (bench[i].ep)
+			bench_dir_start(&bench[i]);
+	hub_event_loop(NULL, bench_progress, bench_secs * 1000);
+	stop = now_ns();
 
-	return 0;
+	bench_stop = true;
+	for (i = 0; i < 2; i++)
+		if (bench[i].ep)
+			bench_dir_cancel(&bench[i]);
+	while (bench[0].inflight > 0 || bench[1].inflight > 0)
+		libusb_handle_events(NULL);
+	for (i = 0; i < 2; i++) {
+		if (bench[i].ep == 0)
+			continue;
+		if (bench_iso)
+			bench_iso_report(&bench[i], (stop - start) / 1e9);
+		else
+			bench_report(&bench[i], (stop - start) / 1e9);
+	}
+
+release:
+	for (i = 0; i < 2; i++)
+		if (bench[i].ep)
+			bench_dir_free(&bench[i]);
+	libusb_release_interface(handle, intf);
+out:
+	if (handle)
+		libusb_close(handle);
+	topo_free();
+	libusb_exit(NULL);
+	return r;
 }
 
 int main(int argc, char** argv)
 {
 	bool show_help = false;
-	int j, r, fd;
+	int j, r;
 	size_t i, arglen;
 	unsigned tmp_vid, tmp_pid, tmp_portnum;
 	unsigned int usb_mode, usb_num, usb_speed, test_pattern, super_flag, regs1, regs2, regs3, addr;
 	void *base;
+	char *params[8];
+	int nparams = 0;
+	const char *monitor_list = NULL;
+	bool feed_watch = false;
+	bool list_topology = false;
+	const char *decode_path = NULL;
+	uint64_t init_start;
+	unsigned int feed_interval_ms = 0;
 
 	// Default to generic, expecting VID:PID
 	VID = 0;
@@ -358,19 +4069,78 @@ int main(int argc, char** argv)
 			arglen = strlen(argv[j]);
 			if ( (argv[j][0] == '-') && (arglen >= 2) ) {
 				if (strcmp(argv[j], "-host") == 0) {
-					if (argc < 7) {
-						printf("Please provide more parameters\n");
-						return 1;
-					}
 					usb_mode = 2;
 					host_test_mode = true;
 				} else if (strcmp(argv[j], "-device") == 0) {
-					if (argc < 7) {
-						printf("Please provide more parameters\n");
-						return 1;
-					}
 					usb_mode = 1;
 					device_test_mode = true;
+				} else if (strncmp(argv[j], "-trigger=", 9) == 0) {
+					if (capture_cfg.ntrig == MAX_TRIGGERS) {
+						printf("At most %d triggers are supported\n", MAX_TRIGGERS);
+						return 1;
+					}
+					if (link_trigger_parse(argv[j] + 9, &capture_cfg.trig[capture_cfg.ntrig]) < 0) {
+						printf("Bad trigger \"%s\", use \"field==val\", \"field!=val\" or \"field:change\"\n", argv[j] + 9);
+						return 1;
+					}
+					capture_cfg.ntrig++;
+				} else if (strncmp(argv[j], "-pre=", 5) == 0) {
+					capture_cfg.pre = strtoul(argv[j] + 5, NULL, 0);
+					if (capture_cfg.pre > MAX_CAPTURE_SAMPLES) {
+						printf("Please specify the samples before the trigger as \"-pre=n\", n 0~%d\n", MAX_CAPTURE_SAMPLES);
+						return 1;
+					}
+				} else if (strncmp(argv[j], "-post=", 6) == 0) {
+					capture_cfg.post = strtoul(argv[j] + 6, NULL, 0);
+					if (capture_cfg.post > MAX_CAPTURE_SAMPLES) {
+						printf("Please specify the samples after the trigger as \"-post=n\", n 0~%d\n", MAX_CAPTURE_SAMPLES);
+						return 1;
+					}
+				} else if (strncmp(argv[j], "-capture=", 9) == 0) {
+					capture_cfg.path = argv[j] + 9;
+				} else if (strncmp(argv[j], "-monitor=", 9) == 0) {
+					monitor_list = argv[j] + 9;
+				} else if (strncmp(argv[j], "-flap_alarm=", 12) == 0) {
+					if (sscanf(argv[j], "-flap_alarm=%u/%u", &flap_alarm_count, &flap_alarm_secs) != 2 ||
+					    flap_alarm_count < 2 || flap_alarm_count > MAX_FLAP_ALARM) {
+						printf("Please specify the flap alarm as \"-flap_alarm=count/seconds\", count 2~%d\n", MAX_FLAP_ALARM);
+						return 1;
+					}
+				} else if (strncmp(argv[j], "-metrics=", 9) == 0) {
+					metrics_path = argv[j] + 9;
+				} else if (strncmp(argv[j], "-metrics_interval=", 18) == 0) {
+					metrics_interval_s = strtoul(argv[j] + 18, NULL, 0);
+					if (metrics_interval_s == 0) {
+						printf("Please specify the metrics interval in seconds as \"-metrics_interval=s\"\n");
+						return 1;
+					}
+				} else if (strncmp(argv[j], "-trace=", 7) == 0) {
+					trace_path = argv[j] + 7;
+				} else if (strncmp(argv[j], "-trace_secs=", 12) == 0) {
+					trace_secs = strtoul(argv[j] + 12, NULL, 0);
+					if (trace_secs == 0) {
+						printf("Please specify the trace length in seconds as \"-trace_secs=s\"\n");
+						return 1;
+					}
+				} else if (strncmp(argv[j], "-decode=", 8) == 0) {
+					decode_path = argv[j] + 8;
+				} else if (strcmp(argv[j], "-quiet") == 0) {
+					monitor_quiet = true;
+				} else if (strcmp(argv[j], "-shm") == 0) {
+					feed_name = LINK_FEED_NAME;
+				} else if (strncmp(argv[j], "-shm=", 5) == 0) {
+					feed_name = argv[j] + 5;
+				} else if (strcmp(argv[j], "-feed") == 0) {
+					feed_watch = true;
+				} else if (strncmp(argv[j], "-feed=", 6) == 0) {
+					feed_watch = true;
+					feed_interval_ms = strtoul(argv[j] + 6, NULL, 0);
+				} else if (strncmp(argv[j], "-period=", 8) == 0) {
+					monitor_period_us = strtoul(argv[j] + 8, NULL, 0);
+					if (monitor_period_us == 0) {
+						printf("Please specify the sample period in us as \"-period=us\"\n");
+						return 1;
+					}
 				} else if ((argv[j][1] == 'h') && (argv[j][2] == 'u') && (argv[j][3] == 'b')) {
 					if ((arglen <= 4) || argv[j][4] != '=') {
 						printf("Please specify port number to be test as \"-hub=portnum\" in decimal format\n");
@@ -386,6 +4156,80 @@ int main(int argc, char** argv)
 							printf("portnum %d\n", PORTNUM);
 						}
 					}
+				} else if (strcmp(argv[j], "-all") == 0) {
+					hub_all = true;
+				} else if (strncmp(argv[j], "-path=", 6) == 0) {
+					if (nhub_paths == MAX_HUBS) {
+						printf("At most %d hub paths are supported\n", MAX_HUBS);
+						return 1;
+					}
+					hub_paths[nhub_paths++] = argv[j] + 6;
+				} else if (strcmp(argv[j], "-list") == 0) {
+					list_topology = true;
+				} else if (strcmp(argv[j], "-hotplug") == 0) {
+					hub_hotplug = true;
+				} else if (strcmp(argv[j], "-sweep") == 0) {
+					hub_sweep = true;
+					hub_test_mode = true;
+				} else if (strncmp(argv[j], "-sel=", 5) == 0) {
+					hub_selector = hub_selector_parse(argv[j] + 5);
+					if (hub_selector == 0) {
+						printf("Please specify the test selector as \"-sel=J|K|SE0_NAK|Packet|Force_Enable\" or 1~5\n");
+						return 1;
+					}
+				} else if (strncmp(argv[j], "-workers=", 9) == 0) {
+					hub_nworkers = strtoul(argv[j] + 9, NULL, 0);
+					if (hub_nworkers < 1 || hub_nworkers > MAX_HUB_WORKERS) {
+						printf("Please specify the number of workers as \"-workers=n\", n 1~%d\n", MAX_HUB_WORKERS);
+						return 1;
+					}
+				} else if (strcmp(argv[j], "-bulk") == 0) {
+					bench_mode = true;
+				} else if (strcmp(argv[j], "-iso") == 0) {
+					bench_mode = true;
+					bench_iso = true;
+				} else if (strncmp(argv[j], "-packets=", 9) == 0) {
+					bench_packets = strtoul(argv[j] + 9, NULL, 0);
+					if (bench_packets < 1 || bench_packets > BENCH_MAX_ISO_PACKETS) {
+						printf("Please specify the packets per iso transfer as \"-packets=n\", n 1~%d\n", BENCH_MAX_ISO_PACKETS);
+						return 1;
+					}
+				} else if (strncmp(argv[j], "-dir=", 5) == 0) {
+					if (strcmp(argv[j] + 5, "in") == 0) {
+						bench_dirs = BENCH_IN;
+					} else if (strcmp(argv[j] + 5, "out") == 0) {
+						bench_dirs = BENCH_OUT;
+					} else if (strcmp(argv[j] + 5, "both") == 0) {
+						bench_dirs = BENCH_IN | BENCH_OUT;
+					} else {
+						printf("Please specify the direction as \"-dir=in|out|both\"\n");
+						return 1;
+					}
+				} else if (strncmp(argv[j], "-qdepth=", 8) == 0) {
+					bench_qdepth = strtoul(argv[j] + 8, NULL, 0);
+					if (bench_qdepth < 1 || bench_qdepth > BENCH_MAX_QDEPTH) {
+						printf("Please specify the queue depth as \"-qdepth=n\", n 1~%d\n", BENCH_MAX_QDEPTH);
+						return 1;
+					}
+				} else if (strncmp(argv[j], "-size=", 6) == 0) {
+					bench_size = strtoul(argv[j] + 6, NULL, 0);
+					if (bench_size == 0) {
+						printf("Please specify the transfer size in bytes as \"-size=n\"\n");
+						return 1;
+					}
+				} else if (strncmp(argv[j], "-secs=", 6) == 0) {
+					bench_secs = strtoul(argv[j] + 6, NULL, 0);
+					if (bench_secs < 1 || bench_secs > BENCH_MAX_SECS) {
+						printf("Please specify the benchmark length in seconds as \"-secs=s\", s 1~%d\n", BENCH_MAX_SECS);
+						return 1;
+					}
+				} else if (strncmp(argv[j], "-desc_cache=", 12) == 0) {
+					desc_cache_path = argv[j][12] ? argv[j] + 12 : NULL;
+				} else if (strcmp(argv[j], "-restore") == 0) {
+					hub_restore_only = true;
+					hub_test_mode = true;
+				} else if (strncmp(argv[j], "-dwell=", 7) == 0) {
+					hub_dwell_ms = strtoul(argv[j] + 7, NULL, 0);
 				} else if (strcmp(argv[j], "-help") == 0) {
 					show_help = true;
 				}
@@ -401,13 +4245,21 @@ int main(int argc, char** argv)
 					}
 					VID = (uint16_t)tmp_vid;
 					PID = (uint16_t)tmp_pid;
+					if (nhub_ids == MAX_HUBS) {
+						printf("At most %d vid:pid are supported\n", MAX_HUBS);
+						return 1;
+					}
+					hub_ids[nhub_ids].vid = VID;
+					hub_ids[nhub_ids++].pid = PID;
+				} else if (nparams < 8) {
+					params[nparams++] = argv[j];
 				}
 			}
 		}
 	}
 
 	if ((show_help) || (argc == 1)) {
-		printf("usage: %s [help] [-hub=num vid:pid] [-host] [-device]\n", argv[0]);
+		printf("usage: %s [help] [-hub=num vid:pid|-all] [-host] [-device] [-monitor=list]\n", argv[0]);
 		printf("   help        : display usage\n");
 		printf("   -host       : host_test_mode\n");
 		printf("   -device     : device_test_mode\n");
@@ -417,11 +4269,86 @@ int main(int argc, char** argv)
 		printf("	[test_mode] mode1~mode5\n");
 		printf("	[ncr_phy_regs] \n");
 		printf("   -hub=num    : hub_test_mode [num = 0 : upstream] [num >= 1 : specify downstream port to be test]\n");
-		printf("	[vid:pid] is necessary under hub_test_mode\n");
+		printf("	[vid:pid] is necessary under hub_test_mode, unless -all or -path is given\n");
+		printf("	[vid:pid] may be repeated, every attached device with a given id is tested\n");
+		printf("   -sel=s      : with -hub=num, test selector J, K, SE0_NAK, Packet or Force_Enable (default Packet)\n");
+		printf("   -all        : with -hub=num, test every hub attached to the system at once\n");
+		printf("   -hotplug    : with -hub=num, arm each matching hub (vid:pid, or any hub plugged in later) as soon as it is attached\n");
+		printf("   -path=b-p.p : with -hub=num, select a hub by bus and port chain, e.g. 1-1.4, may be repeated\n");
+		printf("   -list       : print bus-port paths of all attached devices\n");
+		printf("   -sweep      : test every downstream port with every selector, resetting the hub between steps\n");
+		printf("   -dwell=ms   : time each sweep step stays in test mode (default %u)\n", hub_dwell_ms);
+		printf("   -restore    : take the selected hubs out of test mode (resume ports, reset hubs) and wait for them\n");
+		printf("   -workers=n  : with -hub=num, split the devices over n threads, each with its own libusb context\n");
+		printf("   -desc_cache=f : hub descriptor cache file, empty to disable (default %s)\n", HUB_DESC_CACHE);
+		printf("   -bulk       : bulk throughput and latency benchmark against vid:pid or -path\n");
+		printf("   -iso        : isochronous bandwidth, packet error and jitter benchmark against vid:pid or -path\n");
+		printf("   -packets=n  : packets per iso transfer (default %u)\n", bench_packets);
+		printf("   -dir=d      : benchmark direction in, out or both (default both)\n");
+		printf("   -qdepth=n   : transfers in flight per direction (default %u)\n", bench_qdepth);
+		printf("   -size=n     : bytes per bulk transfer (default %u)\n", bench_size);
+		printf("   -secs=s     : benchmark length (default %u)\n", bench_secs);
+		printf("   -trigger=expr : capture a window around a link event, may be repeated\n");
+		printf("	[expr] field==val, field!=val or field:change\n");
+		printf("	[field] gctl_opmode u2_spd u3_spd u3_link ltssm_link ltssm_sub dsts_speed dsts_link\n");
+		printf("   -pre=n      : samples kept before the trigger (default %u)\n", capture_cfg.pre);
+		printf("   -post=n     : samples recorded after the trigger (default %u)\n", capture_cfg.post);
+		printf("   -capture=f  : capture file (default %s)\n", capture_cfg.path);
+		printf("   -monitor=list : only monitor link state of the listed controllers, e.g. 1,2 or 1:100,2:1000\n");
+		printf("	[list] usb_num[:period_us], comma separated\n");
+		printf("   -period=us  : default sample period (default %u)\n", monitor_period_us);
+		printf("   -quiet      : do not print every sample\n");
+		printf("   -flap_alarm=n/s : alarm when n link flaps happen within s seconds\n");
+		printf("   -trace=f    : keep the last samples in memory mapped ring file f\n");
+		printf("   -trace_secs=s : trace ring length in seconds (default %u)\n", trace_secs);
+		printf("   -decode=f   : print the samples kept in trace file f\n");
+		printf("   -metrics=f  : write Prometheus text metrics to file f\n");
+		printf("   -metrics_interval=s : metrics update period (default %u)\n", metrics_interval_s);
+		printf("   -shm[=name] : publish live link state in POSIX shared memory (default %s)\n", LINK_FEED_NAME);
+		printf("   -feed[=ms]  : print the published link state, once or every ms\n");
+		return 0;
+	}
+
+	if (decode_path)
+		return trace_decode(decode_path);
+
+	if (feed_watch) {
+		if (feed_name == NULL)
+			feed_name = LINK_FEED_NAME;
+		return link_feed_watch(feed_interval_ms);
+	}
+
+	if (monitor_list && !hub_test_mode && !host_test_mode && !device_test_mode) {
+		if (monitor_parse_ports(monitor_list) < 0) {
+			printf("Please specify controllers as \"-monitor=1,2\" or \"-monitor=1:100,2:1000\"\n");
+			return 1;
+		}
+		return monitor_run();
+	}
+
+	if (bench_mode)
+		return bench_run() < 0 ? 1 : 0;
+
+	if (list_topology) {
+		r = libusb_init(NULL);
+		if (r < 0)
+			return r;
+		if (topo_scan(NULL) == 0)
+			topo_print();
+		topo_free();
+		libusb_exit(NULL);
 		return 0;
 	}
 
 	if (hub_test_mode && !host_test_mode && !device_test_mode) {
+		if (hub_nworkers > 1 && hub_hotplug) {
+			printf("-workers cannot be used with -hotplug\n");
+			return 1;
+		}
+		if (hub_sweep && (upstream_flag || hub_hotplug)) {
+			printf("-sweep walks the downstream ports of opened hubs, it cannot be used with -hub=0 or -hotplug\n");
+			return 1;
+		}
 		r = libusb_init(NULL);
 		if (r < 0)
 			return r;
@@ -434,15 +4361,19 @@ int main(int argc, char** argv)
 	}
 
 	if (!hub_test_mode && (host_test_mode || device_test_mode)) {
+		if (nparams < 6) {
+			printf("Please provide more parameters\n");
+			return 1;
+		}
 		super_flag = 0;
-		usb_num = atoi(argv[2]);
-		usb_speed = atoi(argv[3]);
-		test_pattern = atoi(argv[4]);
-		regs1 = atoi(argv[5]);
-		regs2 = atoi(argv[6]);
-		regs3 = atoi(argv[7]);
-		if (argc > 8)
-			super_flag = atoi(argv[8]);
+		usb_num = atoi(params[0]);
+		usb_speed = atoi(params[1]);
+		test_pattern = atoi(params[2]);
+		regs1 = atoi(params[3]);
+		regs2 = atoi(params[4]);
+		regs3 = atoi(params[5]);
+		if (nparams > 6)
+			super_flag = atoi(params[6]);
 
 		printf("enter test %d %d %d \nTUNE: 0x%x\n", regs1, regs2, regs3, PHY_NCR_REG_MASK | (regs1<<6 | regs2<<11 | regs3<<13));
 		if (usb_num == 1)
@@ -451,17 +4382,9 @@ int main(int argc, char** argv)
 			addr = 0x62360000;
 		printf("usb %d mode %d speed %d addr %lx test_pattern %d\n", usb_num, usb_mode, usb_speed, addr, test_pattern);
 
-		fd = open("/dev/mem", O_RDWR);
-		if (fd < 0) {
-			printf("open /dev/mem fail fd %d\n", fd);
-			return fd;
-		}
-
-		base = mmap(NULL, 0x40000, PROT_READ | PROT_WRITE, MAP_SHARED, fd, addr);
-		if (base == NULL) {
-			printf("map  fail\n");
+		if (monitor_add_port(usb_num, 0) < 0)
 			return -1;
-		}
+		base = ports[0].base;
 
 		if (super_flag) {
 			RMWREG32(base+0xc2c0, 30, 1, 0);
@@ -470,47 +4393,46 @@ int main(int argc, char** argv)
 			return 0;
 		}
 
+		init_start = now_ns();
 		usb_init(usb_num, base, usb_mode, usb_speed, regs1, regs2, regs3);
+		ports[0].init_ns = now_ns() - init_start;
+		ports[0].tuned = true;
+		ports[0].tune[0] = regs1;
+		ports[0].tune[1] = regs2;
+		ports[0].tune[2] = regs3;
 		sleep(1);
 		printf("usb init ok\n");
 	
 		if (usb_mode == 1) { //devices
 			if (usb_speed == 1) { //full
-				RMWREG32(base+0xc704, 1, 4, test_pattern);
-				RMWREG32(base+0xc704, 31, 1, 1);
-				usb_check_link_state(base);
+				timeline_queue_write(0, 0xC704, 1, 4, test_pattern, test_pattern);
+				timeline_queue_write(0, 0xC704, 31, 1, 1, test_pattern);
 			} else if (usb_speed == 2) { //high
-				RMWREG32(base+0xc704, 1, 4, test_pattern);
-				RMWREG32(base+0xc704, 31, 1, 1);
-				usb_check_link_state(base);
+				timeline_queue_write(0, 0xC704, 1, 4, test_pattern, test_pattern);
+				timeline_queue_write(0, 0xC704, 31, 1, 1, test_pattern);
 			} if (usb_speed == 3) { //super
-				RMWREG32(base+0xc2c0, 30, 1, 1);
-				RMWREG32(base+0xc704, 31, 1, 1);
-				usb_check_link_state(base);
+				timeline_queue_write(0, 0xC2C0, 30, 1, 1, test_pattern);
+				timeline_queue_write(0, 0xC704, 31, 1, 1, test_pattern);
 			}
 		} else if (usb_mode == 2) { //host
 			if (usb_speed == 1) { //low
-				RMWREG32(base+0x424, 28, 4, test_pattern);
+				timeline_queue_write(0, 0x424, 28, 4, test_pattern, test_pattern);
 				if (test_pattern == USB_TEST_SOF)
-					RMWREG32(base+0x20, 0, 1, 1);
+					timeline_queue_write(0, 0x20, 0, 1, 1, test_pattern);
 			} else if (usb_speed == 1) { //full
-				RMWREG32(base+0x424, 28, 4, test_pattern);
+				timeline_queue_write(0, 0x424, 28, 4, test_pattern, test_pattern);
 				if (test_pattern == USB_TEST_SOF)
-					RMWREG32(base+0x20, 0, 1, 1);
+					timeline_queue_write(0, 0x20, 0, 1, 1, test_pattern);
 			} else if (usb_speed == 2) { //high
-				RMWREG32(base+0x424, 28, 4, test_pattern);
+				timeline_queue_write(0, 0x424, 28, 4, test_pattern, test_pattern);
 				if (test_pattern == USB_TEST_SOF)
-					RMWREG32(base+0x20, 0, 1, 1);
+					timeline_queue_write(0, 0x20, 0, 1, 1, test_pattern);
 			} if (usb_speed == 3) { //super
-				RMWREG32(base+0x430, 9, 1, 0);
-				RMWREG32(base+0xc2c0, 30, 1, 1);
-				RMWREG32(base+0x430, 9, 1, 1);
+				timeline_queue_write(0, 0x430, 9, 1, 0, test_pattern);
+				timeline_queue_write(0, 0xC2C0, 30, 1, 1, test_pattern);
+				timeline_queue_write(0, 0x430, 9, 1, 1, test_pattern);
 			}
 		}
-		while (1) {
-			usleep(100);	
-			usb_check_link_state(base);
-		}
-		return 0;
+		return monitor_run();
 	}
 }